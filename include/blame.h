@@ -0,0 +1,108 @@
+#ifndef MINIDOC_BLAME_H
+#define MINIDOC_BLAME_H
+
+#include <vector>
+#include <algorithm>
+#include "patch_graph.h"
+
+namespace MiniDoc {
+
+  /*
+     the patch that last changed each line of a document, kept in step with a patch sequence
+
+     lines are blamed as a whole, a hunk replaces the lines its old text touched
+      with the lines its new text touches, and every one of those is blamed on it
+     lines before and after the hunk only move and keep their blame
+
+     the entries a hunk replaced are kept, so the latest patches can be taken back
+
+     the earliest patches can be folded into the add file patch by squash, the lines keep the blame they have
+      and later patches are numbered on from the folded ones, so a line is always blamed on the same number
+  */
+  class BlameIndex {
+    struct Applied {
+      std::size_t line;
+      std::size_t removed;
+      std::size_t inserted;
+      // offset of the removed entries in saved
+      std::size_t saved;
+    };
+
+    std::vector<std::size_t> lines_;
+    std::vector<Applied> applied;
+    std::vector<std::size_t> saved;
+    // the patches folded into the add file patch
+    std::size_t squashed = 0;
+
+    void pop() {
+      auto & a = applied.back();
+      auto at = lines_.begin() + a.line;
+      lines_.erase(at, at + a.inserted);
+      lines_.insert(lines_.begin() + a.line, saved.begin() + a.saved, saved.end());
+      saved.resize(a.saved);
+      applied.pop_back();
+    }
+
+    public:
+
+    // every line is blamed on the add file patch, the patch pushed next is numbered on from squashed
+    void reset(std::size_t lines, std::size_t squashed = 0) {
+      lines_.assign(std::max<std::size_t>(lines, 1), 0);
+      applied.clear();
+      saved.clear();
+      this->squashed = squashed;
+    }
+
+    // takes back every patch from size on and folds the ones before it into the add file patch
+    //  the lines keep their blame, and the patch pushed next is numbered on from the folded ones
+    void squash(std::size_t size) {
+      truncate(size);
+      squashed += applied.size();
+      applied.clear();
+      saved.clear();
+    }
+
+    // the number of patches applied, including the add file patch
+    std::size_t size() const {
+      return applied.size() + 1;
+    }
+
+    // takes back every patch from size on
+    void truncate(std::size_t size) {
+      size = std::max<std::size_t>(size, 1);
+      while (this->size() > size) {
+        pop();
+      }
+    }
+
+    // blames the lines shape touches on the next patch
+    void push(const HunkShape & shape) {
+      Applied a;
+      a.line = std::min(shape.line, lines_.size() - 1);
+      a.removed = std::min(shape.old_lines + 1, lines_.size() - a.line);
+      a.inserted = shape.new_lines + 1;
+      a.saved = saved.size();
+      auto at = lines_.begin() + a.line;
+      saved.insert(saved.end(), at, at + a.removed);
+      lines_.erase(at, at + a.removed);
+      lines_.insert(lines_.begin() + a.line, a.inserted, squashed + size());
+      applied.push_back(a);
+    }
+
+    std::size_t lines() const {
+      return lines_.size();
+    }
+
+    std::size_t blame(std::size_t line) const {
+      return line < lines_.size() ? lines_[line] : 0;
+    }
+
+    // the blame of count lines from line, lines past the end are not included
+    std::vector<std::size_t> blame(std::size_t line, std::size_t count) const {
+      line = std::min(line, lines_.size());
+      count = std::min(count, lines_.size() - line);
+      return std::vector<std::size_t>(lines_.begin() + line, lines_.begin() + line + count);
+    }
+  };
+}
+#endif
@@ -214,6 +214,118 @@ namespace MiniDoc {
     using Base::invalidate;
   };
   
+  /*
+     compile-time counterpart of Cache
+
+     the getter is a template parameter instead of a DarcsPatch::function
+     so a miss is a direct call that the compiler is free to inline
+
+     Getter must provide a static call(const Args & ...) returning V
+
+     example usage
+
+        MINIDOC_STATIC_CACHE_FUNC(cache_length, AdapterPieceTableWithLineInfo::length);
+        MINIDOC_STATIC_CACHE_FUNC(cache_lines, AdapterPieceTableWithLineInfo::lines);
+
+        auto caches() {
+            return std::tie(cache_lines, cache_length);
+        }
+
+        StaticCacheInvalidator::invalidate(caches());
+
+  */
+  template <typename Getter, typename V, typename ... Args>
+  class StaticCache {
+    mutable V value;
+    mutable std::tuple<Args...> dep;
+    mutable bool invalidated = true;
+    mutable uint32_t hits = 0, argument_misses = 0, invalidated_misses = 0;
+    const char* name = "default";
+
+    public:
+
+    StaticCache() = default;
+
+    StaticCache(const char * name) : name(name) {}
+
+    V & operator()(const Args & ... args) const {
+      return getCacheValue(args...);
+    }
+
+    V & getCacheValue(const Args & ... args) const {
+      if (invalidated) {
+        dep = {args...};
+        value = Getter::call(args...);
+        invalidated = false;
+        invalidated_misses++;
+      } else {
+        std::tuple<const Args & ...> a {args...};
+        if (dep != a) {
+          dep = a;
+          value = Getter::call(args...);
+          argument_misses++;
+        } else {
+          hits++;
+        }
+      }
+      return value;
+    }
+
+    // intentionally not marked as const
+    //  if you need to invalidate a const cache
+    //   then your probably using the cache wrong
+    void invalidate() {
+      invalidated = true;
+    }
+  };
+
+  // invalidates every cache in a std::tuple of cache references, see StaticCache
+  struct StaticCacheInvalidator {
+    template <typename ... Caches>
+    static void invalidate(const std::tuple<Caches & ...> & caches) {
+      std::apply([](auto & ... cache) { (cache.invalidate(), ...); }, caches);
+    }
+  };
+
+  template <auto function>
+  struct StaticGetter;
+
+  template <typename R, typename ... P, R (*function)(P...)>
+  struct StaticGetter<function> {
+    using cache_type = StaticCache<StaticGetter, std::decay_t<R>, std::decay_t<P>...>;
+    static R call(const std::decay_t<P> & ... p) {
+      return function(p...);
+    }
+  };
+
+  template <typename f, typename R, typename ... P, R (f::*function)(P...)>
+  struct StaticGetter<function> {
+    using cache_type = StaticCache<StaticGetter, std::decay_t<R>, f*, std::decay_t<P>...>;
+    static R call(f * const & instance, const std::decay_t<P> & ... p) {
+      return (instance->*function)(p...);
+    }
+  };
+
+  // const overload
+  template <typename f, typename R, typename ... P, R (f::*function)(P...) const>
+  struct StaticGetter<function> {
+    using cache_type = StaticCache<StaticGetter, std::decay_t<R>, const f*, std::decay_t<P>...>;
+    static R call(const f * const & instance, const std::decay_t<P> & ... p) {
+      return (instance->*function)(p...);
+    }
+  };
+
+  // adapts a default constructible functor type for use as a StaticCache Getter
+  template <typename F>
+  struct StaticFunctorGetter {
+    template <typename ... Args>
+    static decltype(auto) call(const Args & ... args) {
+      return F()(args...);
+    }
+  };
+
+  #define MINIDOC_STATIC_CACHE_FUNC(name, function_name) typename MiniDoc::StaticGetter<&function_name>::cache_type name = typename MiniDoc::StaticGetter<&function_name>::cache_type(#function_name)
+
   #define MINIDOC_CACHE_FUNC(name, function_name) decltype(MiniDoc::CacheHelper::Get(#function_name, &function_name)) name = MiniDoc::CacheHelper::Get(#function_name, &function_name)
   
   struct CacheHelper {
@@ -0,0 +1,116 @@
+#ifndef MINIDOC_COMPRESS_H
+#define MINIDOC_COMPRESS_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+namespace MiniDoc {
+
+  // LEB128, small values take a single byte
+  inline void put_varint(std::string & out, uint64_t value) {
+    while (value >= 0x80) {
+      out.push_back((char) ((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    out.push_back((char) value);
+  }
+
+  inline uint64_t get_varint(const std::string & in, std::size_t & position) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (position >= in.size()) {
+        throw std::runtime_error("varint is truncated");
+      }
+      auto byte = (unsigned char) in[position++];
+      value |= (uint64_t) (byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    throw std::runtime_error("varint is too long");
+  }
+
+  /*
+     a small LZ77 codec for blocks of cold history
+
+     the stream is a sequence of tokens, each token is
+      varint literal length, the literal bytes,
+      then, unless the input ends there, varint (match length - 4) and varint match offset
+
+     matches are found through a hash of the next 4 bytes, so the compressor is a single pass
+  */
+  namespace LZ {
+
+    inline std::string compress(const std::string & in) {
+      static constexpr unsigned hash_bits = 14;
+      static constexpr std::size_t min_match = 4;
+
+      std::string out;
+      const std::size_t n = in.size();
+      std::vector<int64_t> table(std::size_t(1) << hash_bits, -1);
+
+      auto hash = [&](std::size_t p) {
+        uint32_t v;
+        std::memcpy(&v, in.data() + p, sizeof(v));
+        return (v * 2654435761u) >> (32 - hash_bits);
+      };
+
+      std::size_t anchor = 0;
+      std::size_t i = 0;
+      while (i + min_match <= n) {
+        auto h = hash(i);
+        auto candidate = table[h];
+        table[h] = (int64_t) i;
+        if (candidate >= 0 && std::memcmp(in.data() + candidate, in.data() + i, min_match) == 0) {
+          std::size_t length = min_match;
+          while (i + length < n && in[candidate + length] == in[i + length]) {
+            length++;
+          }
+          put_varint(out, i - anchor);
+          out.append(in, anchor, i - anchor);
+          put_varint(out, length - min_match);
+          put_varint(out, i - candidate);
+          i += length;
+          anchor = i;
+        } else {
+          i++;
+        }
+      }
+      put_varint(out, n - anchor);
+      out.append(in, anchor, n - anchor);
+      return out;
+    }
+
+    inline std::string decompress(const std::string & in, std::size_t size_hint = 0) {
+      std::string out;
+      out.reserve(size_hint);
+      std::size_t position = 0;
+      while (position < in.size()) {
+        auto literal = get_varint(in, position);
+        if (literal > in.size() - position) {
+          throw std::runtime_error("LZ literal is truncated");
+        }
+        out.append(in, position, literal);
+        position += literal;
+        if (position == in.size()) {
+          break;
+        }
+        auto length = get_varint(in, position) + 4;
+        auto offset = get_varint(in, position);
+        if (offset == 0 || offset > out.size()) {
+          throw std::runtime_error("LZ match offset is out of range");
+        }
+        // a match may overlap the bytes it produces
+        auto from = out.size() - offset;
+        for (std::size_t k = 0; k < length; k++) {
+          out.push_back(out[from + k]);
+        }
+      }
+      return out;
+    }
+  }
+}
+#endif
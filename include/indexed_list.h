@@ -0,0 +1,106 @@
+#ifndef MINIDOC_INDEXED_LIST_H
+#define MINIDOC_INDEXED_LIST_H
+
+#include <list>
+#include <cstddef>
+
+namespace MiniDoc {
+
+  /*
+     a list reached by index, looked up from the element reached last
+
+     the piece table reaches its descriptors by index, so a walk over the pieces in order
+      takes a step per piece rather than a walk from the front for every index
+
+     elements are never moved, so the order entries can point at the descriptors
+
+  */
+  template <typename E>
+  class IndexedList {
+    using LIST = std::list<E>;
+
+    LIST list;
+    // the element at cursor_index, or the end of the list if cursor_index is its size
+    mutable typename LIST::iterator cursor = list.end();
+    mutable std::size_t cursor_index = 0;
+
+    typename LIST::iterator seek(std::size_t index) const {
+      auto & l = const_cast<LIST &>(list);
+      auto size = l.size();
+      // start from whichever of the front, the cursor or the back is nearest
+      auto from_cursor = index > cursor_index ? index - cursor_index : cursor_index - index;
+      if (index <= from_cursor && index <= size - index) {
+        cursor = l.begin();
+        cursor_index = 0;
+      } else if (size - index < from_cursor) {
+        cursor = l.end();
+        cursor_index = size;
+      }
+      for (; cursor_index < index; cursor_index++) {
+        ++cursor;
+      }
+      for (; cursor_index > index; cursor_index--) {
+        --cursor;
+      }
+      return cursor;
+    }
+
+    public:
+
+    IndexedList() = default;
+
+    IndexedList(const IndexedList & other) : list(other.list), cursor(list.end()), cursor_index(list.size()) {}
+
+    IndexedList(IndexedList && other) : list(std::move(other.list)), cursor(list.end()), cursor_index(list.size()) {
+      other.clear();
+    }
+
+    IndexedList & operator=(const IndexedList & other) {
+      list = other.list;
+      cursor = list.end();
+      cursor_index = list.size();
+      return *this;
+    }
+
+    IndexedList & operator=(IndexedList && other) {
+      list = std::move(other.list);
+      cursor = list.end();
+      cursor_index = list.size();
+      other.clear();
+      return *this;
+    }
+
+    std::size_t size() const {
+      return list.size();
+    }
+
+    E & at(std::size_t index) {
+      return *seek(index);
+    }
+
+    const E & at(std::size_t index) const {
+      return *seek(index);
+    }
+
+    // index is at most the size of the list
+    void insert(std::size_t index, const E & value) {
+      cursor = list.insert(seek(index), value);
+      cursor_index = index;
+    }
+
+    void push_back(const E & value) {
+      // the end of the list stays the end, one element further on
+      if (cursor == list.end()) {
+        cursor_index++;
+      }
+      list.push_back(value);
+    }
+
+    void clear() {
+      list.clear();
+      cursor = list.end();
+      cursor_index = 0;
+    }
+  };
+}
+#endif
@@ -0,0 +1,176 @@
+#ifndef MINIDOC_LINE_CACHE_H
+#define MINIDOC_LINE_CACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <cinttypes>
+
+namespace MiniDoc {
+
+  /*
+     a byte budgeted LRU of materialized line contents, keyed by (document version, line)
+
+     a budget of zero disables the cache
+
+     edit() moves the cache to the next document version,
+      lines before the edit are kept as is,
+      lines replaced by the edit are dropped,
+      lines after the edit are re-keyed by the difference in line count
+
+     if the cache is asked about a version it did not see an edit() for
+      then it cannot know which lines are still valid and starts over
+
+  */
+  template <typename T, typename adapter_t>
+  class LineCache {
+    struct Entry {
+      std::size_t line;
+      adapter_t content;
+      std::size_t bytes;
+    };
+
+    using LIST = std::list<Entry>;
+
+    // most recently used at the front
+    LIST entries;
+    std::unordered_map<std::size_t, typename LIST::iterator> index;
+    uint64_t version = 0;
+    std::size_t budget_ = 0;
+    std::size_t bytes_ = 0;
+    uint32_t hits_ = 0, misses_ = 0;
+
+    static std::size_t entry_bytes(const adapter_t & content) {
+      return sizeof(Entry) + (content.size() * sizeof(T));
+    }
+
+    void sync(uint64_t version) {
+      if (this->version != version) {
+        clear();
+        this->version = version;
+      }
+    }
+
+    void evict() {
+      while (bytes_ > budget_ && entries.size() != 0) {
+        auto & last = entries.back();
+        bytes_ -= last.bytes;
+        index.erase(last.line);
+        entries.pop_back();
+      }
+    }
+
+    public:
+
+    LineCache() = default;
+
+    LineCache(const LineCache & other) {
+      *this = other;
+    }
+
+    LineCache & operator=(const LineCache & other) {
+      entries = other.entries;
+      index.clear();
+      for (auto it = entries.begin(); it != entries.end(); it++) {
+        index[it->line] = it;
+      }
+      version = other.version;
+      budget_ = other.budget_;
+      bytes_ = other.bytes_;
+      hits_ = other.hits_;
+      misses_ = other.misses_;
+      return *this;
+    }
+
+    bool enabled() const {
+      return budget_ != 0;
+    }
+
+    std::size_t budget() const {
+      return budget_;
+    }
+
+    void set_budget(std::size_t bytes) {
+      budget_ = bytes;
+      evict();
+    }
+
+    std::size_t size() const {
+      return entries.size();
+    }
+
+    std::size_t bytes() const {
+      return bytes_;
+    }
+
+    uint32_t hits() const {
+      return hits_;
+    }
+
+    uint32_t misses() const {
+      return misses_;
+    }
+
+    const adapter_t * find(uint64_t version, std::size_t line) {
+      sync(version);
+      auto it = index.find(line);
+      if (it == index.end()) {
+        misses_++;
+        return nullptr;
+      }
+      hits_++;
+      entries.splice(entries.begin(), entries, it->second);
+      return &it->second->content;
+    }
+
+    void store(uint64_t version, std::size_t line, const adapter_t & content) {
+      if (!enabled()) {
+        return;
+      }
+      sync(version);
+      auto bytes = entry_bytes(content);
+      if (bytes > budget_) {
+        return;
+      }
+      auto it = index.find(line);
+      if (it != index.end()) {
+        bytes_ -= it->second->bytes;
+        entries.erase(it->second);
+        index.erase(it);
+      }
+      entries.push_front({line, content, bytes});
+      index[line] = entries.begin();
+      bytes_ += bytes;
+      evict();
+    }
+
+    // an edit replaced the lines [line, line + old_lines] of version
+    //  with the lines [line, line + new_lines] of new_version
+    void edit(uint64_t version, uint64_t new_version, std::size_t line, std::size_t old_lines, std::size_t new_lines) {
+      sync(version);
+      this->version = new_version;
+      if (entries.size() == 0) {
+        return;
+      }
+      index.clear();
+      for (auto it = entries.begin(); it != entries.end();) {
+        if (it->line >= line) {
+          if (it->line <= line + old_lines) {
+            bytes_ -= it->bytes;
+            it = entries.erase(it);
+            continue;
+          }
+          it->line = (it->line - old_lines) + new_lines;
+        }
+        index[it->line] = it;
+        it++;
+      }
+    }
+
+    void clear() {
+      entries.clear();
+      index.clear();
+      bytes_ = 0;
+    }
+  };
+}
+#endif
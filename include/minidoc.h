@@ -2,9 +2,17 @@
 #define MINIDOC_H
 
 #include <cstddef> // std::nullopt_t
+#include <chrono>
+#include <map>
+#include <sstream>
 
 #include "cache.h"
+#include "line_cache.h"
+#include "indexed_list.h"
 #include "undo.h"
+#include "patch_graph.h"
+#include "blame.h"
+#include "sink.h"
 
 #include <generic_piece_table.h>
 #include <darcs_patch.h>
@@ -180,11 +188,11 @@ namespace MiniDoc {
         typename AdapterMustExtendBasicStringAdapter = typename std::enable_if<std::is_base_of<StringAdapter::BasicStringAdapter<T>, adapter_t>::value>::type
     >
     struct AdapterPieceTable : public GenericPieceTable<
-        std::list<GenericPieceTableDescriptor>,
-        std::list<GenericPieceTableDescriptorOrder>,
+        IndexedList<GenericPieceTableDescriptor>,
+        IndexedList<GenericPieceTableDescriptorOrder>,
         const T*, const T*, adapter_t, adapter_t
     > {
-        using GPT = GenericPieceTable<std::list<GenericPieceTableDescriptor>, std::list<GenericPieceTableDescriptorOrder>, const T*, const T*, adapter_t, adapter_t>;
+        using GPT = GenericPieceTable<IndexedList<GenericPieceTableDescriptor>, IndexedList<GenericPieceTableDescriptorOrder>, const T*, const T*, adapter_t, adapter_t>;
         using USER_DATA_USER_DATA_T = typename GPT::USER_DATA_USER_DATA_T;
         using USER_DATA_START_T = typename GPT::USER_DATA_START_T;
         using USER_DATA_ORIGIN_CONTENT_T = typename GPT::USER_DATA_ORIGIN_CONTENT_T;
@@ -199,40 +207,72 @@ namespace MiniDoc {
         FSPLIT_T fsplit = [](auto * this_, auto & debug, auto & user_data, auto & start, auto & length, auto & user_data2) {};
         FERASE_T ferase = [](auto * this_, auto & debug, auto & user_data, auto & start, auto & length, auto & is_start) {};
 
-        AdapterPieceTable(const AdapterPieceTable<T, adapter_t> & other) : GPT(other) {}
+        // the length of the text appended to each buffer so far
+        //  every append to a buffer reports where it landed through the user data insert callback
+        std::size_t origin_extent = 0;
+        std::size_t append_extent = 0;
+
+        AdapterPieceTable(const AdapterPieceTable<T, adapter_t> & other) : GPT(other), origin_extent(other.origin_extent), append_extent(other.append_extent) {
+            copy_newlines(other);
+        }
 
         AdapterPieceTable & operator=(const AdapterPieceTable<T, adapter_t> & other) {
             GPT::operator=(other);
             finsert = other.finsert;
             fsplit = other.fsplit;
             ferase = other.ferase;
+            origin_extent = other.origin_extent;
+            append_extent = other.append_extent;
+            copy_newlines(other);
             return *this;
         }
 
+        private:
+
+        void copy_newlines(const AdapterPieceTable<T, adapter_t> & other) {
+            for (int i = 0; i < 2; i++) {
+                newlines_[i] = other.newlines_[i];
+                newlines_read_[i] = other.newlines_read_[i];
+            }
+        }
+
+        protected:
+
+        void onReset() override {
+            origin_extent = 0;
+            append_extent = 0;
+            for (int i = 0; i < 2; i++) {
+                newlines_[i].clear();
+                newlines_read_[i] = 0;
+            }
+        }
+
+        public:
+
         AdapterPieceTable() : GPT (
             { // descriptor
                 // reset
-                [](auto & c) { c = {}; },
+                [](auto & c) { c.clear(); },
                 // append
-                [](auto & c, auto & d) { c.emplace_back(d); },
+                [](auto & c, auto & d) { c.push_back(d); },
                 // length
-                [](auto & c) { return std::distance(c.begin(), c.end()); },
+                [](auto & c) { return c.size(); },
                 // const index
-                [](auto & c, auto index) -> const GenericPieceTableDescriptor & { return *std::next(c.begin(), index); },
+                [](auto & c, auto index) -> const GenericPieceTableDescriptor & { return c.at(index); },
                 // index
-                [](auto & c, auto index) -> GenericPieceTableDescriptor & { return *std::next(c.begin(), index); }
+                [](auto & c, auto index) -> GenericPieceTableDescriptor & { return c.at(index); }
             },
             { // descriptor order
                 // reset
-                [](auto & c) { c = {}; },
+                [](auto & c) { c.clear(); },
                 // insert
-                [](auto & c, auto & d, auto index) { c.insert(std::next(c.begin(), index), d); },
+                [](auto & c, auto & d, auto index) { c.insert(index, d); },
                 // length
-                [](auto & c) { return std::distance(c.begin(), c.end()); },
+                [](auto & c) { return c.size(); },
                 // const index
-                [](auto & c, auto index) -> const GenericPieceTableDescriptorOrder & { return *std::next(c.begin(), index); },
+                [](auto & c, auto index) -> const GenericPieceTableDescriptorOrder & { return c.at(index); },
                 // index
-                [](auto & c, auto index) -> GenericPieceTableDescriptorOrder & { return *std::next(c.begin(), index); }
+                [](auto & c, auto index) -> GenericPieceTableDescriptorOrder & { return c.at(index); }
             },
             { // origin
                 // reset
@@ -246,7 +286,11 @@ namespace MiniDoc {
                 // container index to char
                 [](auto & c, auto index) -> const char { return c.index_to_char(index); },
                 // user data insert
-                [](auto * this_, auto & debug, auto & user_data, auto & start, auto & content, auto & content_length) { static_cast<AdapterPieceTable<T, adapter_t>*>(this_)->finsert(this_, debug, user_data, start, content, content_length); },
+                [](auto * this_, auto & debug, auto & user_data, auto & start, auto & content, auto & content_length) {
+                    auto self = static_cast<AdapterPieceTable<T, adapter_t>*>(this_);
+                    self->origin_extent = std::max<std::size_t>(self->origin_extent, start + content_length);
+                    self->finsert(this_, debug, user_data, start, content, content_length);
+                },
                 // user data split
                 [](auto * this_, auto & debug, auto & user_data, auto & start, auto & length, auto & user_data_2) { static_cast<AdapterPieceTable<T, adapter_t>*>(this_)->fsplit(this_, debug, user_data, start, length, user_data_2); },
                 // user data erase
@@ -255,16 +299,31 @@ namespace MiniDoc {
             { // append
                 // reset
                 [](auto & c) { c = adapter_t(); },
-                // append
-                [](auto & c, auto & content) { c.append(content); },
+                // append, text restored by insert_spans is already in a buffer
+                [](auto & c, auto & content) {
+                    if (content != restore_marker()) {
+                        c.append(content);
+                    }
+                },
                 // container length
                 [](auto & c) { return c.size(); },
                 // content length
-                [](auto & content) { return content == nullptr ? 0 : adapter_t(content).size(); },
+                [](auto & content) {
+                    if (content == restore_marker()) {
+                        return restoring->length;
+                    }
+                    return content == nullptr ? 0 : adapter_t(content).size();
+                },
                 // content index to char
                 [](auto & c, auto index) -> const char { return c.index_to_char(index); },
                 // user data insert
-                [](auto * this_, auto & debug, auto & user_data, auto & start, auto & content, auto & content_length) { static_cast<AdapterPieceTable<T, adapter_t>*>(this_)->finsert(this_, debug, user_data, start, content, content_length); },
+                [](auto * this_, auto & debug, auto & user_data, auto & start, auto & content, auto & content_length) {
+                    auto self = static_cast<AdapterPieceTable<T, adapter_t>*>(this_);
+                    if (content != restore_marker()) {
+                        self->append_extent = std::max<std::size_t>(self->append_extent, start + content_length);
+                    }
+                    self->finsert(this_, debug, user_data, start, content, content_length);
+                },
                 // user data split
                 [](auto * this_, auto & debug, auto & user_data, auto & start, auto & length, auto & user_data_2) { static_cast<AdapterPieceTable<T, adapter_t>*>(this_)->fsplit(this_, debug, user_data, start, length, user_data_2); },
                 // user data erase
@@ -272,6 +331,326 @@ namespace MiniDoc {
             }
         ) {}
 
+        // a range of the origin or append buffer
+        //  the buffers are append only, so a span stays valid until the table is reset
+        struct Span {
+            bool origin;
+            std::size_t start;
+            std::size_t length;
+        };
+
+        using Spans = std::vector<Span>;
+
+        // appends a span, merging it into the last span if they are contiguous
+        static void append_span(Spans & spans, const Span & span) {
+            if (span.length == 0) {
+                return;
+            }
+            if (spans.size() != 0) {
+                auto & last = spans.back();
+                if (last.origin == span.origin && last.start + last.length == span.start) {
+                    last.length += span.length;
+                    return;
+                }
+            }
+            spans.push_back(span);
+        }
+
+        static void append_spans(Spans & spans, const Spans & other) {
+            for (auto & span : other) {
+                append_span(spans, span);
+            }
+        }
+
+        // the start of a span is written relative to the end of the previous span, so most spans take a few bytes
+        static void put_spans(SpillWriter & out, const Spans & spans) {
+            out.put_varint(spans.size());
+            uint64_t end = 0;
+            for (auto & span : spans) {
+                out.put_varint(span.origin ? 1 : 0);
+                out.put_delta(span.start, end);
+                out.put_varint(span.length);
+                end = span.start + span.length;
+            }
+        }
+
+        static Spans get_spans(SpillReader & in) {
+            Spans spans;
+            auto count = in.get_varint();
+            if (count > in.bytes.size() - in.position) {
+                throw std::runtime_error("spill record is truncated");
+            }
+            spans.reserve(count);
+            uint64_t end = 0;
+            for (std::size_t i = 0; i < count; i++) {
+                Span span;
+                span.origin = in.get_varint() != 0;
+                span.start = in.get_delta(end);
+                span.length = in.get_varint();
+                end = span.start + span.length;
+                spans.push_back(span);
+            }
+            return spans;
+        }
+
+        // the part of spans covering [start, start + length) of the text they hold
+        static Spans slice_spans(const Spans & spans, std::size_t start, std::size_t length) {
+            Spans slice;
+            std::size_t LEN = 0;
+            auto end = start + length;
+            for (auto & span : spans) {
+                if (LEN >= end) {
+                    break;
+                }
+                auto next_LEN = LEN + span.length;
+                if (start < next_LEN) {
+                    auto from = start > LEN ? start - LEN : 0;
+                    auto to = end < next_LEN ? end - LEN : span.length;
+                    append_span(slice, {span.origin, span.start + from, to - from});
+                }
+                LEN = next_LEN;
+            }
+            return slice;
+        }
+
+        // replaces [pos, pos + length) of the text spans hold with other
+        static void splice_spans(Spans & spans, std::size_t pos, std::size_t length, const Spans & other) {
+            std::size_t total = 0;
+            for (auto & span : spans) {
+                total += span.length;
+            }
+            pos = std::min(pos, total);
+            length = std::min(length, total - pos);
+            auto next = slice_spans(spans, 0, pos);
+            append_spans(next, other);
+            append_spans(next, slice_spans(spans, pos + length, total - pos - length));
+            spans = std::move(next);
+        }
+
+        // the length of the text a and b share at their start, by buffer position rather than by content
+        static std::size_t common_prefix(const Spans & a, const Spans & b) {
+            std::size_t length = 0;
+            std::size_t i = 0, j = 0, offset_a = 0, offset_b = 0;
+            while (i < a.size() && j < b.size()) {
+                auto & x = a[i];
+                auto & y = b[j];
+                if (x.origin != y.origin || x.start + offset_a != y.start + offset_b) {
+                    break;
+                }
+                auto n = std::min(x.length - offset_a, y.length - offset_b);
+                length += n;
+                offset_a += n;
+                offset_b += n;
+                if (offset_a == x.length) {
+                    i++;
+                    offset_a = 0;
+                }
+                if (offset_b == y.length) {
+                    j++;
+                    offset_b = 0;
+                }
+            }
+            return length;
+        }
+
+        // the length of the text a and b share at their end, by buffer position rather than by content
+        static std::size_t common_suffix(const Spans & a, const Spans & b) {
+            std::size_t length = 0;
+            std::size_t i = a.size(), j = b.size(), offset_a = 0, offset_b = 0;
+            while (i != 0 && j != 0) {
+                auto & x = a[i - 1];
+                auto & y = b[j - 1];
+                if (x.origin != y.origin || x.start + x.length - offset_a != y.start + y.length - offset_b) {
+                    break;
+                }
+                auto n = std::min(x.length - offset_a, y.length - offset_b);
+                length += n;
+                offset_a += n;
+                offset_b += n;
+                if (offset_a == x.length) {
+                    i--;
+                    offset_a = 0;
+                }
+                if (offset_b == y.length) {
+                    j--;
+                    offset_b = 0;
+                }
+            }
+            return length;
+        }
+
+        // the spans holding the text of [start, start + length), without copying the text
+        Spans range_spans(std::size_t start, std::size_t length) const {
+            Spans spans;
+            if (length == 0) {
+                return spans;
+            }
+            auto end = length > (std::size_t)-1 - start ? (std::size_t)-1 : start + length;
+            std::size_t LEN = 0;
+            auto piece_order_size = this->descriptor_count();
+            for (size_t i = 0; i < piece_order_size && LEN < end; i++) {
+                auto & order = this->descriptor_at(i);
+                auto & descriptor = *order.ptr;
+                auto next_LEN = LEN + descriptor.length;
+                if (start < next_LEN) {
+                    auto from = start > LEN ? start - LEN : 0;
+                    auto to = end < next_LEN ? end - LEN : descriptor.length;
+                    append_span(spans, {order.origin, descriptor.start + from, to - from});
+                }
+                LEN = next_LEN;
+            }
+            return spans;
+        }
+
+        adapter_t spans_string_adapter(const Spans & spans) const {
+            adapter_t adapter;
+            spans_string_adapter(spans, adapter);
+            return adapter;
+        }
+
+        void spans_string_adapter(const Spans & spans, adapter_t & out) const {
+            std::size_t len = 0;
+            for (auto & span : spans) {
+                len += span.length;
+            }
+            out.resize(len);
+            std::size_t COUNT = 0;
+            for (auto & span : spans) {
+                auto & info = span.origin ? this->get_origin_info() : this->get_append_info();
+                for (auto i_ = span.start; i_ < (span.start + span.length); i_++) {
+                    out[COUNT] = info.container_index_to_char(i_);
+                    COUNT++;
+                }
+            }
+        }
+
+        // the newlines in [0, pos) of the text spans hold, read from the newlines of the buffers rather than the text
+        std::size_t spans_newlines(const Spans & spans, std::size_t pos) const {
+            std::size_t count = 0;
+            std::size_t LEN = 0;
+            for (auto & span : spans) {
+                if (LEN >= pos) {
+                    break;
+                }
+                auto end = span.start + std::min(span.length, pos - LEN);
+                auto & newlines = buffer_newlines(span.origin, end);
+                count += std::lower_bound(newlines.begin(), newlines.end(), end) - std::lower_bound(newlines.begin(), newlines.end(), span.start);
+                LEN += span.length;
+            }
+            return count;
+        }
+
+        // the position just past the newline number count of the text spans hold, counting from 1
+        //  the length of the text if it holds fewer newlines
+        std::size_t spans_newline_end(const Spans & spans, std::size_t count) const {
+            std::size_t LEN = 0;
+            for (auto & span : spans) {
+                auto & newlines = buffer_newlines(span.origin, span.start + span.length);
+                auto first = std::lower_bound(newlines.begin(), newlines.end(), span.start);
+                std::size_t n = std::lower_bound(first, newlines.end(), span.start + span.length) - first;
+                if (count <= n) {
+                    return LEN + (first[count - 1] - span.start) + 1;
+                }
+                count -= n;
+                LEN += span.length;
+            }
+            return LEN;
+        }
+
+        private:
+
+        // the buffer positions of the newlines of the origin and the append buffer, read as far as a query reaches
+        //  the buffers are append only, so the positions stay valid until the table is reset
+        mutable std::vector<std::size_t> newlines_[2];
+        mutable std::size_t newlines_read_[2] = { 0, 0 };
+
+        const std::vector<std::size_t> & buffer_newlines(bool origin, std::size_t end) const {
+            auto & newlines = newlines_[origin ? 0 : 1];
+            auto & read = newlines_read_[origin ? 0 : 1];
+            if (read < end) {
+                auto & info = origin ? this->get_origin_info() : this->get_append_info();
+                for (; read < end; read++) {
+                    if (info.container_index_to_char(read) == '\n') {
+                        newlines.push_back(read);
+                    }
+                }
+            }
+            return newlines;
+        }
+
+        // the span insert_spans is restoring, the append buffer ops give its length for restore_marker and append nothing
+        inline static thread_local const Span * restoring = nullptr;
+
+        // inserted in place of text by insert_spans, never read
+        static const T * restore_marker() {
+            static const T marker[1] = {};
+            return marker;
+        }
+
+        public:
+
+        // reinstates text that is still held in the buffers at pos, nothing is appended to either buffer
+        //  each span is inserted as a piece of its length at the end of the append buffer, which is then pointed at the span
+        //  the order container is only reached by index, so the pieces are found in a single walk
+        void insert_spans(const Spans & spans, std::size_t pos) {
+            // every append to the append buffer reports where it landed, so its extent is its length
+            auto end = append_extent;
+            // the walk resumes after the last piece found, the next insert does not change the pieces before it
+            std::size_t index = 0;
+            std::size_t LEN = 0;
+            for (auto & span : spans) {
+                if (span.length == 0) {
+                    continue;
+                }
+                restoring = &span;
+                try {
+                    this->insert(restore_marker(), pos);
+                } catch (...) {
+                    restoring = nullptr;
+                    throw;
+                }
+                restoring = nullptr;
+                auto count = this->descriptor_count();
+                bool found = false;
+                for (; index < count && LEN <= pos; index++) {
+                    // the order entries are not const, only the accessor is
+                    auto & order = const_cast<GenericPieceTableDescriptorOrder &>(this->descriptor_at(index));
+                    auto & descriptor = *order.ptr;
+                    if (LEN == pos && !order.origin && descriptor.start == end && descriptor.length == span.length) {
+                        order.origin = span.origin;
+                        descriptor.start = span.start;
+                        found = true;
+                        break;
+                    }
+                    LEN += descriptor.length;
+                }
+                if (!found) {
+                    // the table merged the piece into another, which cannot be pointed at the span
+                    this->erase(pos, span.length);
+                    throw std::runtime_error("a restored span was merged into another piece");
+                }
+                index++;
+                LEN += span.length;
+                pos += span.length;
+            }
+        }
+
+        void replace_spans(const Spans & spans, std::size_t pos, std::size_t length) {
+            this->erase(pos, length);
+            insert_spans(spans, pos);
+        }
+
+        std::size_t spans_count(const Spans & spans, const T & value) const {
+            std::size_t count = 0;
+            for (auto & span : spans) {
+                auto & info = span.origin ? this->get_origin_info() : this->get_append_info();
+                for (auto i_ = span.start; i_ < (span.start + span.length); i_++) {
+                    if (info.container_index_to_char(i_) == value) count++;
+                }
+            }
+            return count;
+        }
+
         adapter_t range_string_adapter_len(std::size_t start, std::size_t length) const {
             adapter_t adapter;
             range_string_adapter_len(start, length, adapter);
@@ -335,7 +714,8 @@ namespace MiniDoc {
                 auto & descriptor = *order.ptr;
                 if (descriptor.length == 0) continue;
                 auto next_LEN = LEN + descriptor.length;
-                if (start < next_LEN) {
+                // LEN stops at the first piece, every piece after it is copied from its start
+                if (found_start || start < next_LEN) {
                     auto buffer_index = descriptor.start;
                     if (!found_start) {
                         found_start = true;
@@ -397,7 +777,8 @@ namespace MiniDoc {
         protected:
 
         void onReset() override {
-            caches.invalidate(this);
+            GPT::onReset();
+            invalidate_caches();
         }
 
         public:
@@ -409,15 +790,15 @@ namespace MiniDoc {
 
             this->finsert = [](auto * this_, auto & debug, auto & user_data, auto & start, auto & content, auto & content_length) {
                 static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->finsert_(this_, debug, user_data, start, content, content_length);
-                static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->caches.invalidate(this_);
+                static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->invalidate_caches();
             };
             this->fsplit = [](auto * this_, auto & debug, auto & user_data, auto & start, auto & length, auto & user_data_2) {
                 static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->fsplit_(this_, debug, user_data, start, length, user_data_2);
-                static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->caches.invalidate(this_);
+                static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->invalidate_caches();
             };
             this->ferase = [](auto * this_, auto & debug, auto & user_data, auto & start, auto & length, auto & is_start) {
                 static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->ferase_(this_, debug, user_data, start, length, is_start);
-                static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->caches.invalidate(this_);
+                static_cast<AdapterPieceTableWithLineInfo<T, adapter_t>*>(this_)->invalidate_caches();
             };
         }
 
@@ -490,15 +871,18 @@ namespace MiniDoc {
             return cache_line_end(this, line);
         }
 
-        MINIDOC_CACHE_FUNC(cache_length, AdapterPieceTableWithLineInfo::length);
-        MINIDOC_CACHE_FUNC(cache_lines, AdapterPieceTableWithLineInfo::lines);
-        MINIDOC_CACHE_FUNC(cache_line_start, AdapterPieceTableWithLineInfo::line_start);
-        MINIDOC_CACHE_FUNC(cache_line_end, AdapterPieceTableWithLineInfo::line_end);
+        MINIDOC_STATIC_CACHE_FUNC(cache_length, AdapterPieceTableWithLineInfo::length);
+        MINIDOC_STATIC_CACHE_FUNC(cache_lines, AdapterPieceTableWithLineInfo::lines);
+        MINIDOC_STATIC_CACHE_FUNC(cache_line_start, AdapterPieceTableWithLineInfo::line_start);
+        MINIDOC_STATIC_CACHE_FUNC(cache_line_end, AdapterPieceTableWithLineInfo::line_end);
 
-        CacheInvalidator caches = [](void * this_) -> std::vector<MiniDoc::CacheBase *> {
-            auto * t = static_cast<AdapterPieceTableWithLineInfo*>(this_);
-            return { &t->cache_lines, &t->cache_length, &t->cache_line_start, &t->cache_line_end };
-        };
+        auto caches() {
+            return std::tie(cache_lines, cache_length, cache_line_start, cache_line_end);
+        }
+
+        void invalidate_caches() {
+            StaticCacheInvalidator::invalidate(caches());
+        }
 
     };
 
@@ -520,6 +904,8 @@ namespace MiniDoc {
             size_t line_length_ = 0;
             size_t column_ = 0;
             size_t length_ = 0;
+            uint64_t version_ = 0;
+            mutable LineCache<T, adapter_t> line_cache;
             
             void updateLineInfo();
 
@@ -533,6 +919,10 @@ namespace MiniDoc {
             size_t lines() const;
             size_t column() const;
             size_t length() const;
+            uint64_t version() const;
+            const LineCache<T, adapter_t> & get_line_cache() const;
+            // the length of the text edits have added to the append buffer, undo and redo reinstate text without adding to it
+            size_t append_extent() const;
             
             using CORE_FP = DarcsPatch::Core_FP<T, adapter_t>;
             
@@ -541,6 +931,21 @@ namespace MiniDoc {
             
             using LAST_OP = typename AdapterPieceTableWithLineInfo<T, adapter_t>::LAST_OP;
 
+            using Spans = typename AdapterPieceTableWithLineInfo<T, adapter_t>::Spans;
+
+            private:
+
+            // set while stepping through history, undo and redo edit these spans rather than the piece table
+            //  and the piece table is brought to them once at the end, see MiniDoc::seek_history
+            Spans * staged = nullptr;
+
+            // the edits of undo records, applied to the staged spans while there are any
+            void apply_erase(std::size_t pos, std::size_t length);
+            void apply_insert(const Spans & spans, std::size_t pos);
+            void apply_replace(const Spans & spans, std::size_t pos, std::size_t length);
+
+            public:
+
             struct UndoInfo : public UndoStack<Info>::Command {
                 LAST_OP op;
                 typename AdapterPieceTableWithLineInfo<T, adapter_t>::LAST_BUFFER buffer;
@@ -550,19 +955,38 @@ namespace MiniDoc {
                 std::size_t erase_position_start;
                 std::size_t erase_length;
 
-                adapter_t content, content2;
+                // the text is not copied, content and content2 refer to the buffers of the piece table of owner
+                const Info * owner;
+                Spans content, content2;
+                std::size_t content_length, content2_length;
 
-                // patch information
+                // patch information, line counts
                 std::size_t line;
-                adapter_t old_lines;
-                adapter_t new_lines;
+                std::size_t old_lines;
+                std::size_t new_lines;
+
+                adapter_t content_str() const;
+                adapter_t content2_str() const;
+
+                UndoInfo() = default;
+                UndoInfo(SpillReader & in);
+
+                std::size_t bytes() const override;
+                bool spill(SpillWriter & out) const override;
 
                 void undo(Info * instance) override;
                 void redo(Info * instance) override;
+
+                // applies the undo, or the redo, of the record to spans and leaves the document alone, see MiniDoc::view_at
+                void stage(Spans & spans, bool undo) const;
+
+                // the record that takes this one back, see MiniDoc::squash_history
+                UndoInfo inverse() const;
+
                 std::ostream & to_stream(std::ostream & os, bool is_inverted) const override;
             };
 
-            std::size_t split_count(const adapter_t & str) const;
+            std::size_t split_count(const Spans & spans) const;
 
             void append_lines(adapter_t & adapter, std::size_t count);
 
@@ -570,7 +994,14 @@ namespace MiniDoc {
 
             void record_patch(UndoInfo * undo_info);
 
-            UndoInfo * makeUndoInfo(const adapter_t & content, const adapter_t & content2);
+            // erased is the text the edit removed, old_length is the length of the document before the edit
+            UndoInfo makeUndoInfo(const Spans & erased, std::size_t old_length);
+
+            // advances the document version, must be called for every edit applied to the piece table
+            void on_edit(const UndoInfo * undo_info, bool inverted);
+
+            // advances the document version after the piece table was changed outside of an edit
+            void on_restore();
 
             void line_str(MINIDOC_STRING & out) const;
             MINIDOC_STRING line_str() const;
@@ -602,20 +1033,181 @@ namespace MiniDoc {
         
         private:
         
-        mutable Info info;
+        // held apart from the document so load can hand the old piece table to the reclaimer
+        //  and so the records and views that refer to it stay valid when the document is moved, see MiniDoc(MiniDoc &&)
+        std::unique_ptr<Info> info = std::unique_ptr<Info>(new Info());
         mutable UndoStack<Info> stack;
         
         public:
 
+        // which consecutive edits are folded into a single undo record
+        struct CoalescePolicy {
+            // an insert that starts where the previous insert ended, typing
+            bool inserts = false;
+            // an erase that ends where the previous erase started, backspace
+            bool backspaces = false;
+            // an erase that starts where the previous erase started, forward delete
+            bool deletes = false;
+            // the longest pause between two edits that are folded, zero for no limit
+            std::chrono::steady_clock::duration window = std::chrono::steady_clock::duration::zero();
+        };
+
+        enum class GraphFormat {
+            DOT,
+            JSON
+        };
+
+        // a diagnostic reported by error_batch, column is counted from the start of line
+        struct Diagnostic {
+            std::size_t line;
+            std::size_t column;
+            std::string message;
+        };
+
+        // the document as it was at an undo stack index, read without moving through the history
+        //  a view refers to the buffers of the document rather than holding its text, it stays valid until the next load, restore or squash_history
+        class View {
+            friend class MiniDoc;
+
+            const Info * owner = nullptr;
+            std::size_t index_ = 0;
+            typename Info::Spans spans;
+            std::size_t length_ = 0;
+            // false until the view is staged
+            //  lines are found from the newlines of the buffers the spans refer to, a view holds no line table
+            bool staged = false;
+
+            public:
+
+            std::size_t index() const;
+            std::size_t length() const;
+            std::size_t lines() const;
+
+            // the line pos is on, the last line for a pos past the end
+            std::size_t line(std::size_t pos) const;
+            std::size_t line_start(std::size_t line) const;
+            // the start of the next line, the length of the view for the last line
+            std::size_t line_end(std::size_t line) const;
+
+            void line_str(std::size_t line, MINIDOC_STRING & out) const;
+            MINIDOC_STRING line_str(std::size_t line) const;
+
+            void str(MINIDOC_STRING & out) const;
+            MINIDOC_STRING str() const;
+        };
+
+        private:
+
+        CoalescePolicy coalesce_policy;
+        std::chrono::steady_clock::time_point last_edit;
+
+        // the name and the edit number of each patch of the undo stack kept between diagnostics, patches[0] is the add file patch
+        //  only the entries past UndoStack::settled are named again, see update_patches
+        //  the hunks themselves are not kept, the graph finds dependencies from the shapes of the edits
+        struct PatchName {
+            std::string name;
+            std::size_t edit;
+        };
+        mutable std::vector<PatchName> patches;
+        // the dependencies of patches, extended as patches are added
+        mutable PatchGraph graph;
+        // the patch that last changed each line, in step with graph
+        mutable BlameIndex blame_index;
+        // the characters each patch replaced and the length of the text it put in their place, in step with graph
+        //  an edit is moved past the later ones by these alone, see undo_edit
+        struct EditSpan {
+            std::size_t pos;
+            std::size_t old_length;
+            std::size_t new_length;
+        };
+        mutable std::vector<EditSpan> edit_spans;
+        // the hash of the name of each patch, found when the patch is built, nodes of an exported graph are named by it
+        mutable std::vector<std::string> patch_hashes;
+        // names are padded to the digits of the undo stack size
+        mutable uint8_t patch_digits = 0;
+        // the edits folded into the document by squash_history, patch p is edit squashed_edits + p
+        std::size_t squashed_edits = 0;
+        std::size_t graph_threads = 1;
+
+        Reclaimer * reclaimer = nullptr;
+
+        // the spans of the document at undo stack indices along the current branch
+        //  a checkpoint holds no text, its size is the number of pieces of the document
+        mutable std::map<std::size_t, typename Info::Spans> checkpoints;
+        std::size_t checkpoint_interval = 256;
+        mutable std::size_t checkpoint_spans = 0;
+        // past this many spans every other checkpoint is dropped and the interval is doubled
+        static constexpr std::size_t checkpoint_span_budget = 1 << 20;
+
+        void drop_checkpoints(std::size_t from) const;
+        void add_checkpoint();
+
+        // brings the document to the text held by target, only the text that differs is replaced
+        void restore_spans(const typename Info::Spans & target) const;
+
+        static constexpr char save_magic[8] = "MiniDoc";
+        static constexpr uint64_t save_version = 2;
+
+        // a view of the document as it is, not staged yet
+        View current_view() const;
+
+        // brings view to index by applying undo records to its spans, starting from the closest checkpoint when that is shorter
+        void stage_view(View & view, std::size_t index) const;
+
+        // undoes or redoes to index as a single change to the piece table, starting from the closest checkpoint
+        //  when that is shorter, returns the previous index
+        std::size_t seek_history(std::size_t index) const;
+
+        bool coalesce(typename Info::UndoInfo * top, const typename Info::UndoInfo * next);
+
+        // may_coalesce is false for records that must stay on their own, such as a committed transaction
+        //  such a record is not folded into the one before it, and the next edit is not folded into it
+        void push_edit(typename Info::UndoInfo && undo_info, bool may_coalesce = true);
+
+        // the document when a transaction or a savepoint began, the innermost is last
+        struct Savepoint {
+            typename Info::Spans spans;
+            std::size_t cursor;
+        };
+        std::vector<Savepoint> savepoints;
+
+        // an edit inside a transaction is not recorded and only updates the length of the document
+        void transaction_edit();
+
+        // undo, redo and the backtrace cannot walk the history while a transaction holds unrecorded edits
+        void require_no_transaction() const;
+
+        public:
+
         const Info & get_info() const;
+        const UndoStack<Info> & undoStack() const;
 
         std::ostream & to_stream(std::ostream & os) const;
 
         MiniDoc();
+
+        // undo records, views and the spill context of the history refer to the Info of the document
+        //  Info is held apart from the document, so they stay valid when it is moved, a moved from document may only be destroyed or assigned to
+        MiniDoc(const MiniDoc &) = delete;
+        MiniDoc & operator=(const MiniDoc &) = delete;
+        MiniDoc(MiniDoc &&) = default;
+        MiniDoc & operator=(MiniDoc &&) = default;
+
         void load(std::nullptr_t stream, size_t length);
         void load(std::nullptr_t stream);
         void load(const T * stream, size_t length);
         void load(const T * stream);
+
+        // writes the document and its undo history in a compact binary form, see restore
+        //  throws std::runtime_error if the stream cannot be written
+        void save(std::ostream & os) const;
+
+        // replaces the document and its undo history with those written by save
+        //  the history is read back into cold storage, undo records are decoded when they are first needed
+        //  the text is read from the stream into place rather than through a copy of the whole stream
+        //  throws std::runtime_error if the stream does not hold a saved document, the document is then empty
+        void restore(std::istream & is);
+
         void seek(size_t pos);
         void seek_line(size_t line);
         void seek_line_start();
@@ -636,6 +1228,7 @@ namespace MiniDoc {
         size_t lines() const;
         size_t column() const;
         size_t length() const;
+        uint64_t version() const;
         
         void line_str(MINIDOC_STRING & out) const;
         MINIDOC_STRING line_str() const;
@@ -648,8 +1241,73 @@ namespace MiniDoc {
         
         bool undo();
         bool redo();
+
+        // undoes or redoes up to n steps as a single change to the document, returns the number of steps taken
+        std::size_t undo(std::size_t n);
+        std::size_t redo(std::size_t n);
+
+        // moves through the history to index, an undo stack size as given by undoStack().undoSize()
+        //  an index past the current one is reached through the redo stack, returns false if it cannot be reached
+        bool undo_to(std::size_t index);
         void set_supports_redo(bool supports_redo);
         void set_supports_advanced_undo(bool supports_advanced_undo);
+
+        // the document at index, undo records are applied to a copy of the spans of the closest checkpoint or of the document
+        //  an index past the current one is read from the redo stack
+        //  throws std::runtime_error if index cannot be reached or while a transaction is open
+        View view_at(std::size_t index) const;
+
+        // folds the edits below index into the document as loaded, the history and the patches then start from the state at index
+        //  undo stack indices start over from index, edit numbers do not, an edit keeps its number in blame and backtraces
+        //  and a line last changed by a folded edit is still blamed on it, lines are blamed as a whole as blame does
+        // the redo stack is kept after the current edit, other branches of the undo tree are dropped
+        //  a saved history does not keep the folded edits, only their count, so a restored history keeps numbering its edits on from them
+        //  throws std::runtime_error if index is past the undo stack or while a transaction is open
+        void squash_history(std::size_t index);
+
+        // opt-in LRU of materialized lines used by line_str, a budget of zero disables it
+        void set_line_cache_budget(std::size_t bytes);
+
+        // the bytes of undo records kept in memory, older records are compressed into cold storage
+        //  and read back when an undo, a redo or a backtrace needs them, zero keeps every record in memory
+        void set_history_budget(std::size_t bytes);
+
+        // cold storage is a temporary file by default
+        void set_cold_storage(ColdStorage storage);
+
+        // the raw bytes of undo records compressed together in cold storage, 16 KiB by default
+        void set_cold_block_size(std::size_t bytes);
+
+        // load and restore hand the old history and piece table to reclaimer instead of destroying them
+        //  use Reclaimer::shared() to free it on a background thread, nullptr (the default) frees it in place
+        void set_reclaimer(Reclaimer * reclaimer);
+
+        // a checkpoint of the document is kept every interval edits to speed up walking the history, zero disables them
+        void set_checkpoint_interval(std::size_t edits);
+
+        // the threads that find the dependencies of a large batch of new patches, the graph is the same for any number
+        //  one (the default) finds them on the calling thread, zero uses one thread per core
+        void set_graph_threads(std::size_t threads);
+
+        // edits are not coalesced by default, undo and redo always end the current record
+        void set_coalesce_policy(const CoalescePolicy & policy);
+        const CoalescePolicy & get_coalesce_policy() const;
+
+        // edits made until the matching commit or rollback are not recorded one by one
+        //  and the line info is only updated by the outermost commit or rollback
+        //  a transaction begun inside another is a savepoint of it
+        // the history cannot be undone, redone, saved, viewed or blamed while a transaction is open, those and error throw std::runtime_error
+        void begin_transaction();
+
+        // ends the innermost transaction, the outermost pushes its net change as a single undo record
+        //  throws std::runtime_error if no transaction is open
+        void commit();
+
+        // brings the document back to where the innermost transaction began, and ends it
+        //  throws std::runtime_error if no transaction is open
+        void rollback();
+
+        bool in_transaction() const;
         
         void append(const T * str);
         void insert(size_t pos, const T * str);
@@ -663,28 +1321,74 @@ namespace MiniDoc {
 
         private:
 
-        DarcsPatch::RL<typename Info::template NAMED<typename Info::CORE_FP>> build_patch_list() const;
+        // brings patches, graph and blame_index up to date with the undo stack
+        //  throws std::runtime_error while a transaction is open
+        void update_patches() const;
 
-        void renderDepsGraphAsDot(const DarcsPatch::DepsGraph<T, adapter_t> & g) const;
+        void renderDepsGraphAsDot(const PatchGraph & g) const;
 
-        void renderDepsGraphAsDot(const DarcsPatch::DepsGraph<T, adapter_t> & g, bool show_hashes) const;
+        void renderDepsGraphAsDot(const PatchGraph & g, bool show_hashes) const;
 
-        void renderDepsGraphAsDot(const DarcsPatch::DepsGraph<T, adapter_t> & g, bool show_hashes, bool show_names_with_hashes) const;
+        void renderDepsGraphAsDot(const PatchGraph & g, bool show_hashes, bool show_names_with_hashes) const;
+
+        void renderDepsGraphAsDot(BufferedSink & out, const PatchGraph & g, bool show_hashes, bool show_names_with_hashes) const;
+
+        void renderDepsGraphAsJson(BufferedSink & out, const PatchGraph & g) const;
 
         void print_graph() const;
 
-        void print_lines(std::size_t line, std::size_t column) const;
+        // prints line and the lines around it, lines is the number of lines and line_str reads one
+        void print_lines(std::ostream & os, std::size_t line, std::size_t column, std::size_t lines, const std::function<MINIDOC_STRING(std::size_t)> & line_str) const;
 
-        std::optional<std::size_t> log_edit(uint64_t edit_id) const;
+        // prints the edit and the lines it was made on, as they were before it, view is moved to the edit
+        //  returns false if there is no such edit
+        bool log_edit(std::ostream & os, uint64_t edit_id, View & view) const;
 
-        void renderDepsGraphAsBacktrace(const DarcsPatch::DepsGraph<T, adapter_t> & g, const std::string & message) const;
+        // prints the diagnostics sorted by line, each followed by the backtrace of its line
+        void renderDepsGraphAsBacktrace(const PatchGraph & g, std::vector<Diagnostic> diagnostics) const;
 
         public:
 
         void error() const;
 
+        // the edit that last changed line, numbered as backtraces number edits, 0 if the line is unchanged since load
+        //  lines are blamed as a whole, an edit is blamed for every line its text touched
+        //  throws std::runtime_error while a transaction is open, its edits are not recorded yet
+        std::size_t blame(std::size_t line) const;
+
+        // the edits that last changed count lines from line, lines past the end are not included
+        std::vector<std::size_t> blame(std::size_t line, std::size_t count) const;
+
         void error(const std::string & message) const;
 
+        // the dependency graph as the last diagnostic or blame left it, see PatchGraph::memo_hit_rate
+        const PatchGraph & patch_graph() const;
+
+        // writes the dependency graph of the undo history to sink, which receives it in pieces of about BufferedSink::default_capacity bytes
+        //  DOT names the nodes by the hashes of the patch names and draws the first dependency of each patch as print_graph does
+        //  JSON lists every patch with its hash, name, edit number and the hashes of all its direct dependencies
+        //  throws std::runtime_error while a transaction is open, and whatever sink throws
+        void export_graph(GraphFormat format, const Sink & sink) const;
+        void export_graph(GraphFormat format, std::ostream & os) const;
+
+        // reports every diagnostic as error does at its line and column, sorted by line
+        //  the patches are brought up to date once and each edit is read from the history once, however many backtraces print it
+        //  throws std::runtime_error while a transaction is open
+        void error_batch(const std::vector<Diagnostic> & diagnostics) const;
+
+        // the later edits that depend directly on edit, numbered as backtraces number edits, ascending
+        //  throws std::runtime_error if there is no such edit or squash_history folded it, or while a transaction is open
+        std::vector<std::size_t> edit_dependents(std::size_t edit) const;
+
+        // takes back edit alone, the edits after it are kept, as a single new edit that is never coalesced
+        //  edit is commuted past every later edit to the top of the history and its inverse is applied there
+        //  the later edits are passed by the lengths kept for every patch, only the record of edit itself is read
+        //  the text edit replaced is reinstated from the buffers it is still in, nothing is appended to them
+        //  returns false and leaves the document alone if a later edit depends on it, see edit_dependents,
+        //  or if a later edit changed characters next to or within its text on a line they share
+        //  throws std::runtime_error if there is no such edit or squash_history folded it, or while a transaction is open
+        bool undo_edit(std::size_t edit);
+
         friend std::ostream & operator<<(std::ostream & os, const MiniDoc<T, adapter_t> & obj) {
             return obj.to_stream(os);
         }
@@ -710,72 +1414,638 @@ namespace MiniDoc {
     }
     
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::load(std::nullptr_t stream, size_t length) {
-        auto a = adapter_t();
-        static const T empty[1] = { a.get_end_of_file() };
-        load(empty, length);
+    void MINIDOC_TEMPLATE_DEF::load(std::nullptr_t stream, size_t length) {
+        auto a = adapter_t();
+        static const T empty[1] = { a.get_end_of_file() };
+        load(empty, length);
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::load(const T* stream) {
+        std::size_t length = 0;
+        auto a = adapter_t();
+        const T & eof = a.get_end_of_file();
+        while(true) {
+            if (stream[length] == eof) {
+                break;
+            }
+            length++;
+        }
+        load(stream, length);
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::load(const T* stream, size_t length) {
+        auto line_cache_budget = info->line_cache.budget();
+        auto history_budget = stack.get_history_budget();
+        auto cold_storage = stack.get_cold_storage();
+        auto cold_block_size = stack.get_cold_block_size();
+        if (reclaimer != nullptr) {
+            reclaimer->retire(std::move(stack));
+            reclaimer->retire(std::move(checkpoints));
+            reclaimer->retire(std::move(info));
+            checkpoints.clear();
+            checkpoint_spans = 0;
+        }
+        info.reset(new Info());
+        info->line_cache.set_budget(line_cache_budget);
+        stack = std::move(UndoStack<Info>());
+        stack.set_history_budget(history_budget);
+        stack.set_cold_storage(cold_storage);
+        stack.set_cold_block_size(cold_block_size);
+        stack.set_spill_context(info.get());
+        stack.set_reclaimer(reclaimer);
+        savepoints.clear();
+        squashed_edits = 0;
+        blame_index = BlameIndex();
+
+        if (length != 0) {
+            auto a = adapter_t(stream, length);
+            auto data = a.data();
+            info->piece.append_origin(data.ptr());
+        }
+        info->updateLineInfo();
+        drop_checkpoints(0);
+        add_checkpoint();
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::save(std::ostream & os) const {
+        using PIECE = AdapterPieceTableWithLineInfo<T, adapter_t>;
+
+        require_no_transaction();
+
+        // the buffers are written up to their extent rather than the text of the document
+        //  undo records refer to buffer positions, so restore must rebuild the buffers as they are
+        SpillWriter out;
+        out.put_bytes(save_magic, sizeof(save_magic));
+        out.put_varint(save_version);
+        out.put_varint(sizeof(T));
+        out.put_varint(squashed_edits);
+        for (bool origin : { true, false }) {
+            std::size_t extent = origin ? info->piece.origin_extent : info->piece.append_extent;
+            out.put_varint(extent);
+            if (extent != 0) {
+                auto text = info->piece.spans_string_adapter({ { origin, 0, extent } });
+                auto data = text.data();
+                out.put_bytes(data.ptr(), extent * sizeof(T));
+            }
+        }
+        PIECE::put_spans(out, info->piece.range_spans(0, info->piece.length_cached()));
+        out.put_varint(info->cursor_);
+        stack.save(out);
+        if (!os.write(out.bytes.data(), out.bytes.size())) {
+            throw std::runtime_error("failed to write the document");
+        }
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::restore(std::istream & is) {
+        using PIECE = AdapterPieceTableWithLineInfo<T, adapter_t>;
+
+        // the buffers are read from the stream into place, only the spans and the history after them are read as a whole
+        SpillStreamReader stream(is);
+        try {
+            char magic[sizeof(save_magic)];
+            if (!stream.get_bytes(magic, sizeof(magic)) || std::memcmp(magic, save_magic, sizeof(save_magic)) != 0) {
+                throw std::runtime_error("not a saved document");
+            }
+            if (stream.get_varint() != save_version || stream.get_varint() != sizeof(T)) {
+                throw std::runtime_error("unsupported saved document version");
+            }
+            auto squashed = stream.get_varint();
+            std::vector<T> buffers[2];
+            for (auto & buffer : buffers) {
+                auto extent = stream.get_varint();
+                if (extent > stream.remaining() / sizeof(T)) {
+                    throw std::runtime_error("saved document is truncated");
+                }
+                buffer.resize(extent);
+                if (!stream.get_bytes(buffer.data(), extent * sizeof(T))) {
+                    throw std::runtime_error("saved document is truncated");
+                }
+            }
+            auto bytes = stream.get_rest();
+            SpillReader in(bytes);
+            auto spans = PIECE::get_spans(in);
+            auto cursor = in.get_varint();
+
+            // the origin buffer is loaded as is and the append buffer is inserted in a single piece
+            //  so both hold the text at the positions the undo records refer to
+            load(buffers[0].data(), buffers[0].size());
+            std::vector<T>().swap(buffers[0]);
+            squashed_edits = squashed;
+            if (buffers[1].size() != 0) {
+                auto a = adapter_t(buffers[1].data(), buffers[1].size());
+                std::vector<T>().swap(buffers[1]);
+                auto data = a.data();
+                info->piece.insert(data.ptr(), info->piece.length_cached());
+            }
+            restore_spans(spans);
+            stack.template restore<typename Info::UndoInfo>(in);
+            info->updateLineInfo();
+            info->seek(cursor);
+            drop_checkpoints(0);
+            add_checkpoint();
+        } catch (...) {
+            load(nullptr);
+            throw;
+        }
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::append(const T * str) {
+        insert(-1, str);
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::insert(size_t pos, const T * str) {
+        if (savepoints.size() != 0) {
+            info->piece.insert(str, pos);
+            transaction_edit();
+            return;
+        }
+        auto old_length = info->length_;
+        info->piece.insert(str, pos);
+        info->updateLineInfo();
+        push_edit(info->makeUndoInfo({}, old_length));
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::replace(size_t pos, const T * str) {
+        replace(pos, 1, str);
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::replace(size_t pos, size_t len, const T * str) {
+        if (savepoints.size() != 0) {
+            info->piece.replace(str, pos, len);
+            transaction_edit();
+            return;
+        }
+        auto erased = info->piece.range_spans(pos, len);
+        auto old_length = info->length_;
+        info->piece.replace(str, pos, len);
+        info->updateLineInfo();
+        push_edit(info->makeUndoInfo(erased, old_length));
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::erase(size_t pos, size_t len) {
+        if (savepoints.size() != 0) {
+            info->piece.erase(pos, len);
+            transaction_edit();
+            return;
+        }
+        auto erased = info->piece.range_spans(pos, len);
+        auto old_length = info->length_;
+        info->piece.erase(pos, len);
+        info->updateLineInfo();
+        push_edit(info->makeUndoInfo(erased, old_length));
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    bool MINIDOC_TEMPLATE_DEF::coalesce(typename Info::UndoInfo * top, const typename Info::UndoInfo * next) {
+        using LAST_OP = typename Info::LAST_OP;
+
+        if (top->op != next->op) {
+            return false;
+        }
+        if (next->op == LAST_OP::LAST_OP_INSERT) {
+            if (coalesce_policy.inserts && next->insert_position_start == top->insert_position_start + top->content_length) {
+                AdapterPieceTableWithLineInfo<T, adapter_t>::append_spans(top->content, next->content);
+                top->content_length += next->content_length;
+                top->new_lines += next->new_lines;
+                return true;
+            }
+        } else if (next->op == LAST_OP::LAST_OP_ERASE) {
+            if (coalesce_policy.backspaces && next->erase_position_start + next->erase_length == top->erase_position_start) {
+                // the erased content now precedes the content erased by top
+                auto content = next->content;
+                AdapterPieceTableWithLineInfo<T, adapter_t>::append_spans(content, top->content);
+                top->content = std::move(content);
+                top->content_length += next->content_length;
+                top->erase_position_start = next->erase_position_start;
+                top->erase_length += next->erase_length;
+                top->line = next->line;
+                top->old_lines += next->old_lines;
+                return true;
+            }
+            if (coalesce_policy.deletes && next->erase_position_start == top->erase_position_start) {
+                AdapterPieceTableWithLineInfo<T, adapter_t>::append_spans(top->content, next->content);
+                top->content_length += next->content_length;
+                top->erase_length += next->erase_length;
+                top->old_lines += next->old_lines;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::push_edit(typename Info::UndoInfo && undo_info, bool may_coalesce) {
+        info->on_edit(&undo_info, false);
+
+        auto now = std::chrono::steady_clock::now();
+        bool in_window = coalesce_policy.window == std::chrono::steady_clock::duration::zero() || now - last_edit <= coalesce_policy.window;
+        last_edit = now;
+
+        auto top = may_coalesce ? static_cast<typename Info::UndoInfo*>(stack.mergeable()) : nullptr;
+        if (top != nullptr && in_window && coalesce(top, &undo_info)) {
+            // the state after top has changed
+            drop_checkpoints(stack.undoSize());
+            return;
+        }
+        // the entries past the current index are replaced by this push
+        drop_checkpoints(stack.undoSize() + 1);
+        stack.template emplace<typename Info::UndoInfo>(std::move(undo_info));
+        if (!may_coalesce) {
+            stack.seal();
+        }
+        add_checkpoint();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::transaction_edit() {
+        info->length_ = info->piece.length_cached();
+        if (info->cursor_ > info->length_) {
+            info->cursor_ = info->length_;
+        }
+        info->on_restore();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::require_no_transaction() const {
+        if (savepoints.size() != 0) {
+            throw std::runtime_error("the history cannot be used while a transaction is open");
+        }
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::begin_transaction() {
+        savepoints.push_back({ info->piece.range_spans(0, info->piece.length_cached()), info->cursor_ });
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::commit() {
+        using PIECE = AdapterPieceTableWithLineInfo<T, adapter_t>;
+        using LAST_OP = typename Info::LAST_OP;
+
+        if (savepoints.size() == 0) {
+            throw std::runtime_error("no transaction is open");
+        }
+        auto start = std::move(savepoints.back().spans);
+        savepoints.pop_back();
+        if (savepoints.size() != 0) {
+            // the outer transaction records the change
+            return;
+        }
+        info->updateLineInfo();
+
+        // the net change is the text between the common prefix and the common suffix
+        auto length = info->piece.length_cached();
+        auto end = info->piece.range_spans(0, length);
+        std::size_t start_length = 0;
+        for (auto & span : start) {
+            start_length += span.length;
+        }
+        auto prefix = PIECE::common_prefix(start, end);
+        auto suffix = std::min(PIECE::common_suffix(start, end), std::min(length, start_length) - prefix);
+        auto old_length = start_length - prefix - suffix;
+        auto new_length = length - prefix - suffix;
+        if (old_length == 0 && new_length == 0) {
+            return;
+        }
+
+        typename Info::UndoInfo undo_info;
+        undo_info.owner = info.get();
+        undo_info.buffer = info->piece.last_buffer;
+        undo_info.insert_position_start = prefix;
+        undo_info.replace_position_start = prefix;
+        undo_info.erase_position_start = prefix;
+        undo_info.replace_length = 0;
+        undo_info.erase_length = 0;
+        undo_info.content2_length = 0;
+        if (old_length == 0) {
+            undo_info.op = LAST_OP::LAST_OP_INSERT;
+            undo_info.content = PIECE::slice_spans(end, prefix, new_length);
+            undo_info.content_length = new_length;
+        } else if (new_length == 0) {
+            undo_info.op = LAST_OP::LAST_OP_ERASE;
+            undo_info.erase_length = old_length;
+            undo_info.content = PIECE::slice_spans(start, prefix, old_length);
+            undo_info.content_length = old_length;
+        } else {
+            undo_info.op = LAST_OP::LAST_OP_REPLACE;
+            undo_info.replace_length = old_length;
+            undo_info.content = PIECE::slice_spans(start, prefix, old_length);
+            undo_info.content_length = old_length;
+            undo_info.content2 = PIECE::slice_spans(end, prefix, new_length);
+            undo_info.content2_length = new_length;
+        }
+        undo_info.line = 0;
+        undo_info.old_lines = 0;
+        undo_info.new_lines = 0;
+        info->record_patch(&undo_info);
+        push_edit(std::move(undo_info), false);
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::rollback() {
+        if (savepoints.size() == 0) {
+            throw std::runtime_error("no transaction is open");
+        }
+        auto savepoint = std::move(savepoints.back());
+        savepoints.pop_back();
+        restore_spans(savepoint.spans);
+        info->cursor_ = savepoint.cursor;
+        if (savepoints.size() != 0) {
+            transaction_edit();
+            return;
+        }
+        info->updateLineInfo();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    bool MINIDOC_TEMPLATE_DEF::in_transaction() const {
+        return savepoints.size() != 0;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::drop_checkpoints(std::size_t from) const {
+        auto it = checkpoints.lower_bound(from);
+        while (it != checkpoints.end()) {
+            checkpoint_spans -= it->second.size();
+            it = checkpoints.erase(it);
+        }
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::add_checkpoint() {
+        if (checkpoint_interval == 0) {
+            return;
+        }
+        auto index = stack.undoSize();
+        if (checkpoints.size() != 0 && index < checkpoints.rbegin()->first + checkpoint_interval) {
+            return;
+        }
+        auto spans = info->piece.range_spans(0, info->length_);
+        checkpoint_spans += spans.size();
+        checkpoints.emplace(index, std::move(spans));
+        if (checkpoint_spans > checkpoint_span_budget) {
+            // thin out the older checkpoints, always keeping the newest
+            bool drop = false;
+            for (auto it = checkpoints.begin(); it != std::prev(checkpoints.end());) {
+                if (drop) {
+                    checkpoint_spans -= it->second.size();
+                    it = checkpoints.erase(it);
+                } else {
+                    it++;
+                }
+                drop = !drop;
+            }
+            checkpoint_interval *= 2;
+        }
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::restore_spans(const typename Info::Spans & target) const {
+        using PIECE = AdapterPieceTableWithLineInfo<T, adapter_t>;
+
+        auto length = info->piece.length_cached();
+        auto current = info->piece.range_spans(0, length);
+        std::size_t target_length = 0;
+        for (auto & span : target) {
+            target_length += span.length;
+        }
+
+        // only the text between the common prefix and the common suffix is replaced
+        //  it is reinstated from the buffers it is already in, so seeking does not grow them, see insert_spans
+        auto prefix = PIECE::common_prefix(current, target);
+        auto suffix = std::min(PIECE::common_suffix(current, target), std::min(length, target_length) - prefix);
+        auto old_length = length - prefix - suffix;
+        auto new_length = target_length - prefix - suffix;
+        if (new_length == 0) {
+            if (old_length != 0) {
+                info->piece.erase(prefix, old_length);
+            }
+        } else {
+            auto middle = PIECE::slice_spans(target, prefix, new_length);
+            if (old_length == 0) {
+                info->piece.insert_spans(middle, prefix);
+            } else {
+                info->piece.replace_spans(middle, prefix, old_length);
+            }
+        }
+        info->on_restore();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::seek_history(std::size_t index) const {
+        require_no_transaction();
+        auto old = stack.undoSize();
+        if (index == old) {
+            return old;
+        }
+        auto limit = old + (stack.supports_redo ? stack.redoSize() : 0);
+        if (index > limit) {
+            index = limit;
+        }
+
+        // the closest checkpoint on either side of index
+        auto distance = index > old ? index - old : old - index;
+        auto it = checkpoints.lower_bound(index);
+        std::optional<std::size_t> best;
+        if (it != checkpoints.end() && it->first <= limit && it->first - index < distance) {
+            best = it->first;
+            distance = it->first - index;
+        }
+        if (it != checkpoints.begin() && index - std::prev(it)->first < distance) {
+            best = std::prev(it)->first;
+        }
+        typename Info::Spans staged;
+        if (best.has_value()) {
+            staged = checkpoints.at(best.value());
+            stack.move_to_index(best.value());
+        } else {
+            staged = info->piece.range_spans(0, info->piece.length_cached());
+        }
+
+        // the steps only edit the staged spans, the piece table and the line info are updated once
+        info->staged = &staged;
+        try {
+            if (index < stack.undoSize()) {
+                stack.undo_to_index(index, info.get());
+            } else {
+                stack.redo_to_index(index, info.get());
+            }
+        } catch (...) {
+            info->staged = nullptr;
+            throw;
+        }
+        info->staged = nullptr;
+        restore_spans(staged);
+        info->updateLineInfo();
+        return old;
+    }
+    
+    MINIDOC_TEMPLATE_IMPL
+    typename MINIDOC_TEMPLATE_DEF::View MINIDOC_TEMPLATE_DEF::current_view() const {
+        View view;
+        view.owner = info.get();
+        view.index_ = stack.undoSize();
+        view.spans = info->piece.range_spans(0, info->piece.length_cached());
+        return view;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::stage_view(View & view, std::size_t index) const {
+        if (view.index_ == index && view.staged) {
+            return;
+        }
+        auto limit = stack.undoSize() + (stack.supports_redo ? stack.redoSize() : 0);
+        if (index > limit) {
+            throw std::runtime_error("the undo stack index cannot be reached");
+        }
+
+        // the closest checkpoint on either side of index
+        auto distance = index > view.index_ ? index - view.index_ : view.index_ - index;
+        auto it = checkpoints.lower_bound(index);
+        std::optional<std::size_t> best;
+        if (it != checkpoints.end() && it->first <= limit && it->first - index < distance) {
+            best = it->first;
+            distance = it->first - index;
+        }
+        if (it != checkpoints.begin() && index - std::prev(it)->first < distance) {
+            best = std::prev(it)->first;
+        }
+        if (best.has_value()) {
+            view.spans = checkpoints.at(best.value());
+            view.index_ = best.value();
+        }
+
+        auto apply = [&](const typename UndoStack<Info>::Command * command, bool undo) {
+            bool inverted = command->is_inverted();
+            auto u = static_cast<const typename Info::UndoInfo*>(inverted ? command->get_command() : command);
+            u->stage(view.spans, undo != inverted);
+        };
+        while (view.index_ > index) {
+            apply(stack.get_step(view.index_ - 1), true);
+            view.index_--;
+        }
+        while (view.index_ < index) {
+            apply(stack.get_step(view.index_), false);
+            view.index_++;
+        }
+
+        view.length_ = 0;
+        for (auto & span : view.spans) {
+            view.length_ += span.length;
+        }
+        view.staged = true;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    typename MINIDOC_TEMPLATE_DEF::View MINIDOC_TEMPLATE_DEF::view_at(std::size_t index) const {
+        require_no_transaction();
+        auto view = current_view();
+        stage_view(view, index);
+        return view;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::squash_history(std::size_t index) {
+        require_no_transaction();
+        if (index > stack.undoSize()) {
+            throw std::runtime_error("the undo stack index cannot be reached");
+        }
+        if (index == 0) {
+            return;
+        }
+
+        // the blame of the state at index is kept as the blame of the lines as loaded
+        update_patches();
+        blame_index.squash(index + 1);
+        squashed_edits += index;
+
+        stack.template squash<typename Info::UndoInfo>(index, [](const typename UndoStack<Info>::Command * command, bool inverted) {
+            auto u = static_cast<const typename Info::UndoInfo*>(command);
+            return inverted ? u->inverse() : *u;
+        });
+
+        // the patches are built again from the kept edits, every patch depends on the state at index rather than the edits before it
+        patches.clear();
+        patch_hashes.clear();
+        edit_spans.clear();
+        graph = PatchGraph();
+
+        // the checkpoints from index on are still on the kept branch
+        std::map<std::size_t, typename Info::Spans> kept;
+        checkpoint_spans = 0;
+        for (auto it = checkpoints.lower_bound(index); it != checkpoints.end(); it++) {
+            checkpoint_spans += it->second.size();
+            kept.emplace(it->first - index, std::move(it->second));
+        }
+        checkpoints = std::move(kept);
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::View::index() const {
+        return index_;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::View::length() const {
+        return length_;
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::load(const T* stream) {
-        std::size_t length = 0;
-        auto a = adapter_t();
-        const T & eof = a.get_end_of_file();
-        while(true) {
-            if (stream[length] == eof) {
-                break;
-            }
-            length++;
-        }
-        load(stream, length);
+    std::size_t MINIDOC_TEMPLATE_DEF::View::lines() const {
+        return owner->piece.spans_newlines(spans, length_) + 1;
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::load(const T* stream, size_t length) {
-        info = std::move(Info());
-        stack = std::move(UndoStack<Info>());
+    std::size_t MINIDOC_TEMPLATE_DEF::View::line(std::size_t pos) const {
+        return owner->piece.spans_newlines(spans, std::min(pos, length_));
+    }
 
-        if (length != 0) {
-            auto a = adapter_t(stream, length);
-            auto data = a.data();
-            info.piece.append_origin(data.ptr());
-        }
-        info.updateLineInfo();
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::View::line_start(std::size_t line) const {
+        return line == 0 ? 0 : owner->piece.spans_newline_end(spans, line);
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::append(const T * str) {
-        insert(-1, str);
+    std::size_t MINIDOC_TEMPLATE_DEF::View::line_end(std::size_t line) const {
+        return owner->piece.spans_newline_end(spans, line + 1);
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::insert(size_t pos, const T * str) {
-        info.piece.insert(str, pos);
-        info.updateLineInfo();
-        stack.push(info.makeUndoInfo(str, ""));
+    void MINIDOC_TEMPLATE_DEF::View::line_str(std::size_t line, MINIDOC_STRING & out) const {
+        using PIECE = AdapterPieceTableWithLineInfo<T, adapter_t>;
+
+        auto start = line_start(line);
+        owner->piece.spans_string_adapter(PIECE::slice_spans(spans, start, line_end(line) - start), out);
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::replace(size_t pos, const T * str) {
-        replace(pos, 1, str);
+    MINIDOC_STRING MINIDOC_TEMPLATE_DEF::View::line_str(std::size_t line) const {
+        MINIDOC_STRING s;
+        line_str(line, s);
+        return s;
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::replace(size_t pos, size_t len, const T * str) {
-        auto erased = info.piece.range_string_adapter_len(pos, len);
-        info.piece.replace(str, pos, len);
-        info.updateLineInfo();
-        stack.push(info.makeUndoInfo(erased, str));
+    void MINIDOC_TEMPLATE_DEF::View::str(MINIDOC_STRING & out) const {
+        owner->piece.spans_string_adapter(spans, out);
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::erase(size_t pos, size_t len) {
-        auto erased = info.piece.range_string_adapter_len(pos, len);
-        info.piece.erase(pos, len);
-        info.updateLineInfo();
-        stack.push(info.makeUndoInfo(erased, ""));
+    MINIDOC_STRING MINIDOC_TEMPLATE_DEF::View::str() const {
+        MINIDOC_STRING s;
+        str(s);
+        return s;
     }
-    
+
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::Info::updateLineInfo() {
         length_ = piece.length_cached();
@@ -810,7 +2080,7 @@ namespace MiniDoc {
 
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::seek(size_t pos) {
-        info.seek(pos);
+        info->seek(pos);
     }
     
     MINIDOC_TEMPLATE_IMPL
@@ -839,7 +2109,7 @@ namespace MiniDoc {
 
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::seek_line(size_t line) {
-        info.seek_line(line);
+        info->seek_line(line);
     }
     
     MINIDOC_TEMPLATE_IMPL
@@ -865,50 +2135,50 @@ namespace MiniDoc {
 
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::seek_line_start() {
-        info.seek_line_start();
+        info->seek_line_start();
     }
     
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::seek_line_start(size_t line) {
-        info.seek_line_start(line);
+        info->seek_line_start(line);
     }
     
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::seek_line_end() {
-        info.seek_line_end();
+        info->seek_line_end();
     }
     
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::seek_line_end(size_t line) {
-        info.seek_line_end(line);
+        info->seek_line_end(line);
     }
     
     MINIDOC_TEMPLATE_IMPL
     bool MINIDOC_TEMPLATE_DEF::has_next() const {
-        return info.cursor_ != (info.length_ == 0 ? 0 : info.length_);
+        return info->cursor_ != (info->length_ == 0 ? 0 : info->length_);
     }
     
     MINIDOC_TEMPLATE_IMPL
     T MINIDOC_TEMPLATE_DEF::next() {
         T ch = character();
         if (has_next()) {
-            info.cursor_++;
-            info.updateLineInfo();
+            info->cursor_++;
+            info->updateLineInfo();
         }
         return ch;
     }
     
     MINIDOC_TEMPLATE_IMPL
     bool MINIDOC_TEMPLATE_DEF::has_previous() const {
-        return info.cursor_ != 0;
+        return info->cursor_ != 0;
     }
     
     MINIDOC_TEMPLATE_IMPL
     T MINIDOC_TEMPLATE_DEF::previous() {
         T ch = character();
         if (has_previous()) {
-            info.cursor_--;
-            info.updateLineInfo();
+            info->cursor_--;
+            info->updateLineInfo();
         }
         return ch;
     }
@@ -1013,44 +2283,71 @@ namespace MiniDoc {
         return length_;
     }
     MINIDOC_TEMPLATE_IMPL
+    size_t MINIDOC_TEMPLATE_DEF::Info::append_extent() const {
+        return piece.append_extent;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    uint64_t MINIDOC_TEMPLATE_DEF::Info::version() const {
+        return version_;
+    }
+    MINIDOC_TEMPLATE_IMPL
+    const LineCache<T, adapter_t> & MINIDOC_TEMPLATE_DEF::Info::get_line_cache() const {
+        return line_cache;
+    }
+    MINIDOC_TEMPLATE_IMPL
     T MINIDOC_TEMPLATE_DEF::character() const {
-        return info.character();
+        return info->character();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::cursor() const {
-        return info.cursor();
+        return info->cursor();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::line_start() const {
-        return info.line_start();
+        return info->line_start();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::line_end() const {
-        return info.line_end();
+        return info->line_end();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::line_length() const {
-        return info.line_length();
+        return info->line_length();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::line() const {
-        return info.line();
+        return info->line();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::lines() const {
-        return info.lines();
+        return info->lines();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::column() const {
-        return info.column();
+        return info->column();
     }
     MINIDOC_TEMPLATE_IMPL
     size_t MINIDOC_TEMPLATE_DEF::length() const {
-        return info.length();
+        return info->length();
+    }
+    MINIDOC_TEMPLATE_IMPL
+    uint64_t MINIDOC_TEMPLATE_DEF::version() const {
+        return info->version();
     }
     
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::Info::line_str(MINIDOC_STRING & out) const {
+        if (line_cache.enabled()) {
+            auto cached = line_cache.find(version_, line_);
+            if (cached != nullptr) {
+                out = *cached;
+                return;
+            }
+            piece.range_string_adapter(line_start_, line_end_, out);
+            line_cache.store(version_, line_, out);
+            return;
+        }
         piece.range_string_adapter(line_start_, line_end_, out);
     }
     MINIDOC_TEMPLATE_IMPL
@@ -1061,7 +2358,7 @@ namespace MiniDoc {
     }
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::line_str(MINIDOC_STRING & out) const {
-        info.line_str(out);
+        info->line_str(out);
     }
     MINIDOC_TEMPLATE_IMPL
     MINIDOC_STRING MINIDOC_TEMPLATE_DEF::line_str() const {
@@ -1081,7 +2378,7 @@ namespace MiniDoc {
     }
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::str(MINIDOC_STRING & out) const {
-        info.str(out);
+        info->str(out);
     }
     MINIDOC_TEMPLATE_IMPL
     MINIDOC_STRING MINIDOC_TEMPLATE_DEF::str() const {
@@ -1102,7 +2399,7 @@ namespace MiniDoc {
     }
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::sub_str(size_t pos, size_t len, MINIDOC_STRING & out) const {
-        info.sub_str(pos, len, out);
+        info->sub_str(pos, len, out);
     }
     MINIDOC_TEMPLATE_IMPL
     MINIDOC_STRING MINIDOC_TEMPLATE_DEF::sub_str(size_t pos, size_t len) const {
@@ -1112,51 +2409,170 @@ namespace MiniDoc {
         return s;
     }
     
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::Info::apply_erase(std::size_t pos, std::size_t length) {
+        if (staged != nullptr) {
+            AdapterPieceTableWithLineInfo<T, adapter_t>::splice_spans(*staged, pos, length, {});
+            return;
+        }
+        piece.erase(pos, length);
+        updateLineInfo();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::Info::apply_insert(const Spans & spans, std::size_t pos) {
+        if (staged != nullptr) {
+            AdapterPieceTableWithLineInfo<T, adapter_t>::splice_spans(*staged, pos, 0, spans);
+            return;
+        }
+        piece.insert_spans(spans, pos);
+        updateLineInfo();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::Info::apply_replace(const Spans & spans, std::size_t pos, std::size_t length) {
+        if (staged != nullptr) {
+            AdapterPieceTableWithLineInfo<T, adapter_t>::splice_spans(*staged, pos, length, spans);
+            return;
+        }
+        piece.replace_spans(spans, pos, length);
+        updateLineInfo();
+    }
+
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::Info::UndoInfo::undo(Info * instance) {
         if (op == LAST_OP::LAST_OP_INSERT) {
-            instance->piece.erase(insert_position_start, content.length());
-            instance->updateLineInfo();
+            instance->apply_erase(insert_position_start, content_length);
         } else if (op == LAST_OP::LAST_OP_REPLACE) {
-            auto shared = content.data();
-            instance->piece.replace(shared.ptr(), replace_position_start, content2.size());
-            instance->updateLineInfo();
+            instance->apply_replace(content, replace_position_start, content2_length);
         } else if (op == LAST_OP::LAST_OP_ERASE) {
-            auto shared = content.data();
-            instance->piece.insert(shared.ptr(), erase_position_start);
-            instance->updateLineInfo();
+            instance->apply_insert(content, erase_position_start);
         }
+        instance->on_edit(this, true);
     }
 
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::Info::UndoInfo::redo(Info * instance) {
         if (op == LAST_OP::LAST_OP_INSERT) {
-            auto shared = content.data();
-            instance->piece.insert(shared.ptr(), insert_position_start);
-            instance->updateLineInfo();
+            instance->apply_insert(content, insert_position_start);
         } else if (op == LAST_OP::LAST_OP_REPLACE) {
-            auto shared = content2.data();
-            instance->piece.replace(shared.ptr(), replace_position_start, replace_length);
-            instance->updateLineInfo();
+            instance->apply_replace(content2, replace_position_start, replace_length);
         } else if (op == LAST_OP::LAST_OP_ERASE) {
-            instance->piece.erase(erase_position_start, erase_length);
-            instance->updateLineInfo();
+            instance->apply_erase(erase_position_start, erase_length);
         }
+        instance->on_edit(this, false);
     }
 
     MINIDOC_TEMPLATE_IMPL
-    std::ostream & MINIDOC_TEMPLATE_DEF::Info::UndoInfo::to_stream(std::ostream & os, bool is_inverted) const {
-        return os << "Minidoc Command: content: \"" << escape<T, adapter_t>(content) << "\", content2: \"" << escape<T, adapter_t>(content2) << "\"";
+    typename MINIDOC_TEMPLATE_DEF::Info::UndoInfo MINIDOC_TEMPLATE_DEF::Info::UndoInfo::inverse() const {
+        // the text an insert put in is the text its inverse erases, and a replace swaps its old and new text
+        UndoInfo inverse = *this;
+        if (op == LAST_OP::LAST_OP_INSERT) {
+            inverse.op = LAST_OP::LAST_OP_ERASE;
+            inverse.erase_position_start = insert_position_start;
+            inverse.erase_length = content_length;
+        } else if (op == LAST_OP::LAST_OP_REPLACE) {
+            inverse.replace_length = content2_length;
+            inverse.content = content2;
+            inverse.content_length = content2_length;
+            inverse.content2 = content;
+            inverse.content2_length = content_length;
+        } else if (op == LAST_OP::LAST_OP_ERASE) {
+            inverse.op = LAST_OP::LAST_OP_INSERT;
+            inverse.insert_position_start = erase_position_start;
+        }
+        inverse.old_lines = new_lines;
+        inverse.new_lines = old_lines;
+        return inverse;
     }
 
     MINIDOC_TEMPLATE_IMPL
-    std::size_t MINIDOC_TEMPLATE_DEF::Info::split_count(const adapter_t & str) const {
-        std::size_t count = 0;
-        const auto & nl = str.get_new_line();
-        for (const auto & c : str) {
-            if (c == nl) count++;
+    void MINIDOC_TEMPLATE_DEF::Info::UndoInfo::stage(Spans & spans, bool undo) const {
+        using PIECE = AdapterPieceTableWithLineInfo<T, adapter_t>;
+
+        if (undo) {
+            if (op == LAST_OP::LAST_OP_INSERT) {
+                PIECE::splice_spans(spans, insert_position_start, content_length, {});
+            } else if (op == LAST_OP::LAST_OP_REPLACE) {
+                PIECE::splice_spans(spans, replace_position_start, content2_length, content);
+            } else if (op == LAST_OP::LAST_OP_ERASE) {
+                PIECE::splice_spans(spans, erase_position_start, 0, content);
+            }
+        } else {
+            if (op == LAST_OP::LAST_OP_INSERT) {
+                PIECE::splice_spans(spans, insert_position_start, 0, content);
+            } else if (op == LAST_OP::LAST_OP_REPLACE) {
+                PIECE::splice_spans(spans, replace_position_start, replace_length, content2);
+            } else if (op == LAST_OP::LAST_OP_ERASE) {
+                PIECE::splice_spans(spans, erase_position_start, erase_length, {});
+            }
         }
-        return count;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::ostream & MINIDOC_TEMPLATE_DEF::Info::UndoInfo::to_stream(std::ostream & os, bool is_inverted) const {
+        return os << "Minidoc Command: content: \"" << escape<T, adapter_t>(content_str()) << "\", content2: \"" << escape<T, adapter_t>(content2_str()) << "\"";
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    MINIDOC_TEMPLATE_DEF::Info::UndoInfo::UndoInfo(SpillReader & in) {
+        op = static_cast<LAST_OP>(in.get_varint());
+        buffer = static_cast<decltype(buffer)>(in.get_varint());
+        insert_position_start = in.get_varint();
+        replace_position_start = in.get_delta(insert_position_start);
+        replace_length = in.get_varint();
+        erase_position_start = in.get_delta(insert_position_start);
+        erase_length = in.get_varint();
+        owner = static_cast<const Info *>(in.context);
+        content = AdapterPieceTableWithLineInfo<T, adapter_t>::get_spans(in);
+        content2 = AdapterPieceTableWithLineInfo<T, adapter_t>::get_spans(in);
+        content_length = in.get_varint();
+        content2_length = in.get_varint();
+        line = in.get_varint();
+        old_lines = in.get_varint();
+        new_lines = in.get_varint();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::Info::UndoInfo::bytes() const {
+        return sizeof(UndoInfo) + ((content.capacity() + content2.capacity()) * sizeof(typename Spans::value_type));
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    bool MINIDOC_TEMPLATE_DEF::Info::UndoInfo::spill(SpillWriter & out) const {
+        // positions are written relative to the insert position, so most fields take a byte
+        // owner is not written, it is the context of the stack the record is read back for
+        out.put_varint(static_cast<uint64_t>(op));
+        out.put_varint(static_cast<uint64_t>(buffer));
+        out.put_varint(insert_position_start);
+        out.put_delta(replace_position_start, insert_position_start);
+        out.put_varint(replace_length);
+        out.put_delta(erase_position_start, insert_position_start);
+        out.put_varint(erase_length);
+        AdapterPieceTableWithLineInfo<T, adapter_t>::put_spans(out, content);
+        AdapterPieceTableWithLineInfo<T, adapter_t>::put_spans(out, content2);
+        out.put_varint(content_length);
+        out.put_varint(content2_length);
+        out.put_varint(line);
+        out.put_varint(old_lines);
+        out.put_varint(new_lines);
+        return true;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    adapter_t MINIDOC_TEMPLATE_DEF::Info::UndoInfo::content_str() const {
+        return owner->piece.spans_string_adapter(content);
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    adapter_t MINIDOC_TEMPLATE_DEF::Info::UndoInfo::content2_str() const {
+        return owner->piece.spans_string_adapter(content2);
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::Info::split_count(const Spans & spans) const {
+        adapter_t str;
+        return piece.spans_count(spans, str.get_new_line());
     }
 
     MINIDOC_TEMPLATE_IMPL
@@ -1188,7 +2604,7 @@ namespace MiniDoc {
 
             // our content could add new lines
             //
-            append_lines(undo_info->new_lines, split_count(undo_info->content));
+            undo_info->new_lines = split_count(undo_info->content);
         } else if (undo_info->op == LAST_OP::LAST_OP_REPLACE) {
             // record a replacement
             //
@@ -1207,9 +2623,9 @@ namespace MiniDoc {
             undo_info->line = piece.get_line(undo_info->replace_position_start);
 
             // the old line count is our old content
-            append_lines(undo_info->old_lines, split_count(undo_info->content));
+            undo_info->old_lines = split_count(undo_info->content);
             // the new line count is our new contents
-            append_lines(undo_info->new_lines, split_count(undo_info->content2));
+            undo_info->new_lines = split_count(undo_info->content2);
         } else if (undo_info->op == LAST_OP::LAST_OP_ERASE) {
             // record an erasure
             //
@@ -1222,7 +2638,7 @@ namespace MiniDoc {
             // we know our new line has a line count of zero, and new_line is already empty
 
             // our erasure content could remove new lines
-            append_lines(undo_info->old_lines, split_count(undo_info->content));
+            undo_info->old_lines = split_count(undo_info->content);
         }
     }
 
@@ -1239,21 +2655,62 @@ namespace MiniDoc {
     }
 
     MINIDOC_TEMPLATE_IMPL
-    typename MINIDOC_TEMPLATE_DEF::Info::UndoInfo * MINIDOC_TEMPLATE_DEF::Info::makeUndoInfo(const adapter_t & content, const adapter_t & content2) {
-        UndoInfo * undo_info = new UndoInfo();
-        undo_info->op = piece.last_op;
-        undo_info->buffer = piece.last_buffer;
-        undo_info->insert_position_start = piece.last_calculated_insert_position_start;
-        undo_info->replace_position_start = piece.last_calculated_replace_position_start;
-        undo_info->replace_length = piece.last_calculated_replace_length;
-        undo_info->erase_position_start = piece.last_calculated_erase_position_start;
-        undo_info->erase_length = piece.last_calculated_erase_length;
-        undo_info->content = content;
-        undo_info->content2 = content2;
-        record_patch(undo_info);
+    typename MINIDOC_TEMPLATE_DEF::Info::UndoInfo MINIDOC_TEMPLATE_DEF::Info::makeUndoInfo(const Spans & erased, std::size_t old_length) {
+        UndoInfo undo_info;
+        undo_info.owner = this;
+        undo_info.op = piece.last_op;
+        undo_info.buffer = piece.last_buffer;
+        undo_info.insert_position_start = piece.last_calculated_insert_position_start;
+        undo_info.replace_position_start = piece.last_calculated_replace_position_start;
+        undo_info.replace_length = piece.last_calculated_replace_length;
+        undo_info.erase_position_start = piece.last_calculated_erase_position_start;
+        undo_info.erase_length = piece.last_calculated_erase_length;
+        std::size_t erased_length = 0;
+        for (auto & span : erased) {
+            erased_length += span.length;
+        }
+        // every insert appends its text to the append buffer, so the inserted text is the end of it
+        auto inserted_length = (length_ + erased_length) - old_length;
+        Spans inserted;
+        AdapterPieceTableWithLineInfo<T, adapter_t>::append_span(inserted, { false, piece.append_extent - inserted_length, inserted_length });
+        if (undo_info.op == LAST_OP::LAST_OP_INSERT) {
+            undo_info.content = std::move(inserted);
+            undo_info.content_length = inserted_length;
+            undo_info.content2_length = 0;
+        } else if (undo_info.op == LAST_OP::LAST_OP_REPLACE) {
+            undo_info.content = erased;
+            undo_info.content_length = erased_length;
+            undo_info.content2 = std::move(inserted);
+            undo_info.content2_length = inserted_length;
+        } else {
+            undo_info.content = erased;
+            undo_info.content_length = erased_length;
+            undo_info.content2_length = 0;
+        }
+        undo_info.line = 0;
+        undo_info.old_lines = 0;
+        undo_info.new_lines = 0;
+        record_patch(&undo_info);
         return undo_info;
     }
 
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::Info::on_edit(const UndoInfo * undo_info, bool inverted) {
+        auto old_lines = undo_info->old_lines;
+        auto new_lines = undo_info->new_lines;
+        if (inverted) {
+            std::swap(old_lines, new_lines);
+        }
+        line_cache.edit(version_, version_ + 1, undo_info->line, old_lines, new_lines);
+        version_++;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::Info::on_restore() {
+        // the line cache starts over when it sees a version it was not told about
+        version_++;
+    }
+
     MINIDOC_TEMPLATE_IMPL
     std::ostream & MINIDOC_TEMPLATE_DEF::Info::to_stream(std::ostream & os) const {
         os << "MiniDoc::Info start" << std::endl;
@@ -1273,22 +2730,61 @@ namespace MiniDoc {
     }
 
     MINIDOC_TEMPLATE_IMPL
-    const typename MINIDOC_TEMPLATE_DEF::Info & MINIDOC_TEMPLATE_DEF::get_info() const { return info; }
+    const typename MINIDOC_TEMPLATE_DEF::Info & MINIDOC_TEMPLATE_DEF::get_info() const { return *info; }
+
+    MINIDOC_TEMPLATE_IMPL
+    const UndoStack<typename MINIDOC_TEMPLATE_DEF::Info> & MINIDOC_TEMPLATE_DEF::undoStack() const { return stack; }
 
     MINIDOC_TEMPLATE_IMPL
     std::ostream & MINIDOC_TEMPLATE_DEF::to_stream(std::ostream & os) const {
         os << "MiniDoc start" << std::endl;
         os << "    info: " << std::endl;
-        return info.to_stream(os) << std::endl << "    undo stack: " << stack << std::endl << "MiniDoc end";
+        return info->to_stream(os) << std::endl << "    undo stack: " << stack << std::endl << "MiniDoc end";
     }
 
     MINIDOC_TEMPLATE_IMPL
     bool MINIDOC_TEMPLATE_DEF::undo() {
-        return stack.undo(&info);
+        require_no_transaction();
+        if (!stack.undo(info.get())) {
+            return false;
+        }
+        if (!stack.supports_redo) {
+            // the undone entry is gone
+            drop_checkpoints(stack.undoSize() + 1);
+        }
+        return true;
     }
     MINIDOC_TEMPLATE_IMPL
     bool MINIDOC_TEMPLATE_DEF::redo() {
-        return stack.redo(&info);
+        require_no_transaction();
+        return stack.redo(info.get());
+    }
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::undo(std::size_t n) {
+        auto old = stack.undoSize();
+        undo_to(n > old ? 0 : old - n);
+        return old - stack.undoSize();
+    }
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::redo(std::size_t n) {
+        if (!stack.supports_redo) {
+            return 0;
+        }
+        auto old = stack.undoSize();
+        undo_to(old + std::min(n, stack.redoSize()));
+        return stack.undoSize() - old;
+    }
+    MINIDOC_TEMPLATE_IMPL
+    bool MINIDOC_TEMPLATE_DEF::undo_to(std::size_t index) {
+        if (index > stack.undoSize() + (stack.supports_redo ? stack.redoSize() : 0)) {
+            return false;
+        }
+        seek_history(index);
+        if (!stack.supports_redo) {
+            // the undone entries are gone
+            drop_checkpoints(stack.undoSize() + 1);
+        }
+        return true;
     }
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::set_supports_redo(bool supports_redo) {
@@ -1298,10 +2794,50 @@ namespace MiniDoc {
     void MINIDOC_TEMPLATE_DEF::set_supports_advanced_undo(bool supports_advanced_undo) {
         stack.supports_advanced_undo = supports_advanced_undo;
     }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_line_cache_budget(std::size_t bytes) {
+        info->line_cache.set_budget(bytes);
+    }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_history_budget(std::size_t bytes) {
+        stack.set_history_budget(bytes);
+    }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_cold_storage(ColdStorage storage) {
+        stack.set_cold_storage(storage);
+    }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_cold_block_size(std::size_t bytes) {
+        stack.set_cold_block_size(bytes);
+    }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_reclaimer(Reclaimer * reclaimer) {
+        this->reclaimer = reclaimer;
+        stack.set_reclaimer(reclaimer);
+    }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_checkpoint_interval(std::size_t edits) {
+        checkpoint_interval = edits;
+        if (edits == 0) {
+            drop_checkpoints(0);
+        }
+    }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_graph_threads(std::size_t threads) {
+        graph_threads = threads != 0 ? threads : std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::set_coalesce_policy(const CoalescePolicy & policy) {
+        coalesce_policy = policy;
+    }
+    MINIDOC_TEMPLATE_IMPL
+    const typename MINIDOC_TEMPLATE_DEF::CoalescePolicy & MINIDOC_TEMPLATE_DEF::get_coalesce_policy() const {
+        return coalesce_policy;
+    }
 
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::print(std::function<void(const T* in, int*outHex, char*outChar)> conv) const {
-        info.print(conv);
+        info->print(conv);
         std::cout << stack << std::endl;
         printf("\n");
         // print_graph();
@@ -1309,116 +2845,238 @@ namespace MiniDoc {
     }
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::printDocument(std::function<void(const T* in, int*outHex, char*outChar)> conv) const {
-        info.printDocument(conv);
+        info->printDocument(conv);
         printf("\n");
     }
 
     MINIDOC_TEMPLATE_IMPL
-    DarcsPatch::RL<typename MINIDOC_TEMPLATE_DEF::Info::template NAMED<typename MINIDOC_TEMPLATE_DEF::Info::CORE_FP>> MINIDOC_TEMPLATE_DEF::build_patch_list() const {
+    void MINIDOC_TEMPLATE_DEF::update_patches() const {
+        // the edits of an open transaction are not in the undo stack yet
+        require_no_transaction();
 
-        auto digits = numDigits(stack.undoSize());
+        auto size = stack.undoSize();
+        auto digits = numDigits(squashed_edits + size);
 
-        DarcsPatch::RL<typename MINIDOC_TEMPLATE_DEF::Info::template NAMED<typename MINIDOC_TEMPLATE_DEF::Info::CORE_FP>> patch_list;
-        std::size_t patch_id = 0;
-
-        std::string zero;
-        zero.append(digits, '0');
-
-        patch_list = patch_list.push(DarcsPatch::makeNamedWithType<T, adapter_t>(0, zero.c_str(), DarcsPatch::makeAddFile()));
+        // the patches of the entries that are unchanged are kept
+        std::size_t valid = std::min(patches.size(), stack.settled() + 1);
+        graph.truncate(std::min(graph.size(), stack.settled() + 1));
+        blame_index.truncate(std::min(blame_index.size(), graph.size()));
+        // the add file patch replaces nothing
+        edit_spans.resize(graph.size(), { 0, 0, 0 });
+        if (digits != patch_digits) {
+            // every name is padded to the new width
+            valid = 0;
+            patch_digits = digits;
+        }
+        patches.erase(patches.begin() + valid, patches.end());
+        patch_hashes.resize(patches.size());
+        auto hash = [](const PatchName & patch) -> std::string {
+            SHA1 sha1;
+            return sha1(patch.name.data(), patch.name.size());
+        };
+        if (patches.size() == 0) {
+            std::string zero;
+            zero.append(digits, '0');
 
-        stack.transform_undo_stack([&](auto cmd) {
-            patch_id++;
-            std::string num;
-            num.append(digits - numDigits(patch_id), '0');
-            num.append(std::to_string(patch_id));
+            patches.push_back({ zero, 0 });
+            patch_hashes.push_back(hash(patches.back()));
+        }
 
+        // the shapes of the patches the graph does not have yet, pushed together so their walks can be shared among threads
+        std::vector<HunkShape> shapes;
+        auto graph_size = graph.size();
+        for (std::size_t patch_id = std::min(patches.size(), graph_size); patch_id <= size; patch_id++) {
+            auto cmd = stack.get_index(patch_id - 1);
             bool inverted = cmd->is_inverted();
             const typename Info::UndoInfo * command = static_cast<const typename Info::UndoInfo*>(inverted ? cmd->get_command() : cmd);
-            auto hunk = DarcsPatch::makeHunk<T, adapter_t>(command->line, command->old_lines, command->new_lines);
+            HunkShape shape { command->line, command->old_lines, command->new_lines };
             if (inverted) {
-                hunk = hunk->invert();
+                shape = shape.invert();
             }
-            patch_list = patch_list.push(DarcsPatch::makeNamedWithType<T, adapter_t>(patch_id, num, hunk));
-        });
-        return patch_list;
+            if (patch_id >= graph_size) {
+                shapes.push_back(shape);
+                EditSpan span { 0, 0, 0 };
+                if (command->op == Info::LAST_OP::LAST_OP_INSERT) {
+                    span = { command->insert_position_start, 0, command->content_length };
+                } else if (command->op == Info::LAST_OP::LAST_OP_REPLACE) {
+                    span = { command->replace_position_start, command->replace_length, command->content2_length };
+                } else if (command->op == Info::LAST_OP::LAST_OP_ERASE) {
+                    span = { command->erase_position_start, command->erase_length, 0 };
+                }
+                if (inverted) {
+                    std::swap(span.old_length, span.new_length);
+                }
+                edit_spans.push_back(span);
+            }
+            if (patch_id < patches.size()) {
+                continue;
+            }
+
+            auto edit = squashed_edits + patch_id;
+            std::string num;
+            num.append(digits - numDigits(edit), '0');
+            num.append(std::to_string(edit));
+            patches.push_back({ num, edit });
+            patch_hashes.push_back(hash(patches.back()));
+        }
+        graph.push(shapes, graph_threads);
+        stack.settle();
+
+        if (blame_index.lines() == 0) {
+            // the lines of the document when it was loaded, numbered on from the squashed edits
+            auto lines = info->lines_;
+            for (std::size_t patch = 1; patch < graph.size(); patch++) {
+                auto & shape = graph.shape(patch);
+                lines = lines - shape.new_lines + shape.old_lines;
+            }
+            blame_index.reset(lines, squashed_edits);
+        }
+        for (std::size_t patch = blame_index.size(); patch < graph.size(); patch++) {
+            blame_index.push(graph.shape(patch));
+        }
     }
 
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsDot(const DarcsPatch::DepsGraph<T, adapter_t> & g) const {
+    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsDot(const PatchGraph & g) const {
         renderDepsGraphAsDot(g, false, true);
     }
 
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsDot(const DarcsPatch::DepsGraph<T, adapter_t> & g, bool show_hashes) const {
+    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsDot(const PatchGraph & g, bool show_hashes) const {
         renderDepsGraphAsDot(g, false, show_hashes);
     }
 
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsDot(const DarcsPatch::DepsGraph<T, adapter_t> & g, bool show_hashes, bool show_names_with_hashes) const {
-        std::cout << "digraph {";
+    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsDot(const PatchGraph & g, bool show_hashes, bool show_names_with_hashes) const {
+        BufferedSink out(BufferedSink::to(std::cout));
+        renderDepsGraphAsDot(out, g, show_hashes, show_names_with_hashes);
+        out.flush();
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsDot(BufferedSink & out, const PatchGraph & g, bool show_hashes, bool show_names_with_hashes) const {
+        out << "digraph {";
         auto indent = "   ";
-        std::cout << "\n" << indent << "graph [rankdir=LR];";
-        std::cout << "\n" << indent << "node [imagescale=true];";
+        out << "\n" << indent << "graph [rankdir=LR];";
+        out << "\n" << indent << "node [imagescale=true];";
 
-        auto showID = [] (auto & key) {
-            SHA1 sha1;
-            auto & n = key.name.c_str();
-            return sha1(n.ptr(), n.lengthInBytes());
+        auto showName = [&](std::size_t patch) {
+            auto & n = patches[patch].name;
+            out.write(n.data(), n.size());
         };
 
-        auto showNode = [&](auto & key) {
-            std::cout << "\n" << indent << "\"" << showID(key) << "\" [label=" << key.name << "]";
+        auto showNode = [&](std::size_t patch) {
+            out << "\n" << indent << "\"" << patch_hashes[patch] << "\" [label=";
+            showName(patch);
+            out << "]";
         };
 
-        auto showEdges = [&](auto & key, auto & value) {
+        auto showEdges = [&](std::size_t patch, auto & value) {
             auto begin = value.begin();
             if (begin != value.end()) {
+                auto dependency = *begin;
                 if (show_hashes) {
-                    std::cout << "\n" << indent << "\"" << showID(key) << "\"";
+                    out << "\n" << indent << "\"" << patch_hashes[patch] << "\"";
                     if (show_names_with_hashes) {
-                        std::cout << " [label=" << key.name << "]";
+                        out << " [label=";
+                        showName(patch);
+                        out << "]";
                     }
-                    std::cout << " -> " << "{\"" << showID(*begin) << "\"";
+                    out << " -> " << "{\"" << patch_hashes[dependency] << "\"";
                     if (show_names_with_hashes) {
-                        std::cout << " [label=" << (*begin).name << "]";
+                        out << " [label=";
+                        showName(dependency);
+                        out << "]";
                     }
-                    std::cout << "}";
+                    out << "}";
                 } else {
-                    std::cout << "\n" << indent << key.name << " -> " << (*begin).name;
+                    out << "\n" << indent;
+                    showName(patch);
+                    out << " -> ";
+                    showName(dependency);
                 }
             }
         };
 
         bool printed = false;
 
-        for(auto & pair : g) {
+        for (std::size_t patch = 0; patch < g.size(); patch++) {
             printed = true;
-            showNode(pair.first);
+            showNode(patch);
         }
 
-        for(auto & pair : g) {
+        for (std::size_t patch = 0; patch < g.size(); patch++) {
             printed = true;
-            showEdges(pair.first, pair.second.v1);
+            showEdges(patch, g.dependencies(patch));
         }
 
         if (printed) {
-            std::cout << "\n";
+            out << "\n";
+        }
+
+        out << "}\n";
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsJson(BufferedSink & out, const PatchGraph & g) const {
+        auto showString = [&](const char * text, std::size_t length) {
+            out << '"';
+            for (std::size_t i = 0; i < length; i++) {
+                if (text[i] == '"' || text[i] == '\\') {
+                    out << '\\';
+                }
+                out << text[i];
+            }
+            out << '"';
+        };
+
+        out << "{\n  \"nodes\": [";
+        for (std::size_t patch = 0; patch < g.size(); patch++) {
+            out << (patch == 0 ? "\n    { \"id\": " : ",\n    { \"id\": ");
+            showString(patch_hashes[patch].data(), patch_hashes[patch].size());
+            out << ", \"name\": ";
+            auto & n = patches[patch].name;
+            showString(n.data(), n.size());
+            out << ", \"edit\": " << (uint64_t)patches[patch].edit << ", \"dependencies\": [";
+            auto & dependencies = g.dependencies(patch);
+            for (std::size_t k = 0; k < dependencies.size(); k++) {
+                if (k != 0) {
+                    out << ", ";
+                }
+                showString(patch_hashes[dependencies[k]].data(), patch_hashes[dependencies[k]].size());
+            }
+            out << "] }";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::export_graph(GraphFormat format, const Sink & sink) const {
+        update_patches();
+        BufferedSink out(sink);
+        if (format == GraphFormat::DOT) {
+            renderDepsGraphAsDot(out, graph, true, false);
+        } else {
+            renderDepsGraphAsJson(out, graph);
         }
+        out.flush();
+    }
 
-        std::cout << "}\n";
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::export_graph(GraphFormat format, std::ostream & os) const {
+        export_graph(format, BufferedSink::to(os));
     }
 
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::print_graph() const {
-        auto graph = DarcsPatch::depsGraph<T, adapter_t>(build_patch_list());
+        update_patches();
         renderDepsGraphAsDot(graph, false);
     }
 
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::print_lines(std::size_t line, std::size_t column) const {
+    void MINIDOC_TEMPLATE_DEF::print_lines(std::ostream & os, std::size_t line, std::size_t column, std::size_t lines, const std::function<MINIDOC_STRING(std::size_t)> & line_str) const {
         auto print_line = [&](std::size_t l, std::size_t col, bool print_cursor) {
-            info.seek_line(l);
-            auto s = line_str();
+            auto s = line_str(l);
             auto c_str = s.c_str();
             std::string prefix = std::string("   ");
             if (print_cursor) {
@@ -1429,160 +3087,142 @@ namespace MiniDoc {
             prefix += " line ";
             prefix += std::to_string(l) + ", column " + std::to_string(col) + " : ";
             std::string escaped = escape(c_str.ptr(), c_str.length());
-            std::cout << prefix << "\"" << escaped << "\"" << std::endl;
+            os << prefix << "\"" << escaped << "\"" << std::endl;
             if (print_cursor) {
                 std::string c;
                 c.append(prefix.size()+1+escape_index(c_str.ptr(), c_str.length(), col), ' ');
                 c.push_back('^');
-                std::cout << c << std::endl;
+                os << c << std::endl;
             }
         };
-        auto lines = info.lines_-1;
+        lines = lines-1;
         if (line == 0) {
             print_line(line, column, true);
             if (lines > 1) {
                 print_line(line+1, 0, false);
-                std::cout << std::endl;
+                os << std::endl;
             }
         } else if (line == 1) {
             print_line(line-1, 0, false);
             print_line(line, column, true);
             if (lines > 2) {
                 print_line(line+1, 0, false);
-                std::cout << std::endl;
+                os << std::endl;
             }
         } else {
             print_line(line-1, 0, false);
             print_line(line, column, true);
             if (line != lines) {
                 print_line(line+1, 0, false);
-                std::cout << std::endl;
+                os << std::endl;
             }
         }
     }
 
     MINIDOC_TEMPLATE_IMPL
-    std::optional<std::size_t> MINIDOC_TEMPLATE_DEF::log_edit(uint64_t edit_id) const {
+    bool MINIDOC_TEMPLATE_DEF::log_edit(std::ostream & os, uint64_t edit_id, View & view) const {
         auto edit = stack.get_index(edit_id);
         if (edit == nullptr) {
-            return std::nullopt;
+            return false;
         }
         bool inverted = edit->is_inverted();
         const typename Info::UndoInfo * u = static_cast<const typename Info::UndoInfo*>(inverted ? edit->get_command() : edit);
         using LAST_OP = typename Info::LAST_OP;
-        auto cursor = info.cursor_;
+        std::size_t pos = 0;
         if (inverted) {
             if (u->op == LAST_OP::LAST_OP_INSERT) {
-                std::cout << " before erase: \"" << escape<T, adapter_t>(u->content) << "\"" << std::endl;
-                info.cursor_ = u->insert_position_start;
-                info.updateLineInfo();
+                os << " before erase: \"" << escape<T, adapter_t>(u->content_str()) << "\"" << std::endl;
+                pos = u->insert_position_start;
             } else if (u->op == LAST_OP::LAST_OP_REPLACE) {
-                std::cout << " before replace: \"" << escape<T, adapter_t>(u->content2) << "\"" << " with \"" << escape<T, adapter_t>(u->content) << "\"" << std::endl;
-                info.cursor_ = u->replace_position_start;
-                info.updateLineInfo();
+                os << " before replace: \"" << escape<T, adapter_t>(u->content2_str()) << "\"" << " with \"" << escape<T, adapter_t>(u->content_str()) << "\"" << std::endl;
+                pos = u->replace_position_start;
             } else if (u->op == LAST_OP::LAST_OP_ERASE) {
-                std::cout << " before insert: \"" << escape<T, adapter_t>(u->content) << "\"" << std::endl;
-                info.cursor_ = u->erase_position_start;
-                info.updateLineInfo();
+                os << " before insert: \"" << escape<T, adapter_t>(u->content_str()) << "\"" << std::endl;
+                pos = u->erase_position_start;
             }
         } else {
             if (u->op == LAST_OP::LAST_OP_INSERT) {
-                std::cout << " before insert: \"" << escape<T, adapter_t>(u->content) << "\"" << std::endl;
-                info.cursor_ = u->insert_position_start;
-                info.updateLineInfo();
+                os << " before insert: \"" << escape<T, adapter_t>(u->content_str()) << "\"" << std::endl;
+                pos = u->insert_position_start;
             } else if (u->op == LAST_OP::LAST_OP_REPLACE) {
-                std::cout << " before replace: \"" << escape<T, adapter_t>(u->content) << "\"" << " with \"" << escape<T, adapter_t>(u->content2) << "\"" << std::endl;
-                info.cursor_ = u->replace_position_start;
-                info.updateLineInfo();
+                os << " before replace: \"" << escape<T, adapter_t>(u->content_str()) << "\"" << " with \"" << escape<T, adapter_t>(u->content2_str()) << "\"" << std::endl;
+                pos = u->replace_position_start;
             } else if (u->op == LAST_OP::LAST_OP_ERASE) {
-                std::cout << " before erase: \"" << escape<T, adapter_t>(u->content) << "\"" << std::endl;
-                info.cursor_ = u->erase_position_start;
-                info.updateLineInfo();
+                os << " before erase: \"" << escape<T, adapter_t>(u->content_str()) << "\"" << std::endl;
+                pos = u->erase_position_start;
             }
         }
-        auto k = stack.undo_to_index(edit_id, &info);
-        auto line = info.line_;
-        auto column = info.column_;
-        print_lines(line, column);
-        info.cursor_ = cursor;
-        info.updateLineInfo();
-        return {k};
+        stage_view(view, edit_id);
+        pos = std::min(pos, view.length());
+        auto line = view.line(pos);
+        print_lines(os, line, pos - view.line_start(line), view.lines(), [&](std::size_t l) { return view.line_str(l); });
+        return true;
     }
 
     MINIDOC_TEMPLATE_IMPL
-    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsBacktrace(const DarcsPatch::DepsGraph<T, adapter_t> & g, const std::string & message) const {
-        auto cursor = info.cursor_;
-        {
-            if (message.length() == 0) {
+    void MINIDOC_TEMPLATE_DEF::renderDepsGraphAsBacktrace(const PatchGraph & g, std::vector<Diagnostic> diagnostics) const {
+        // the lines of the document are read from a view of it as well, every diagnostic reads the same view
+        auto present = current_view();
+        stage_view(present, stack.undoSize());
+
+        std::stable_sort(diagnostics.begin(), diagnostics.end(), [](const Diagnostic & a, const Diagnostic & b) { return a.line < b.line; });
+        for (auto & d : diagnostics) {
+            d.line = std::min(d.line, present.lines() - 1);
+            d.column = std::min(d.column, present.line_end(d.line) - present.line_start(d.line));
+        }
+
+        // a backtrace is the most recent edit on the line, then the first dependency of each edit back to the add file patch
+        //  the edits of every backtrace are found first and printed once, from a single view walked back through the history
+        //  the document and the undo stack are left alone
+        //  a line blamed on an edit folded by squash_history has no backtrace past it
+        auto patch_of = [&](std::size_t edit) -> std::size_t {
+            return edit > squashed_edits ? edit - squashed_edits : 0;
+        };
+        std::vector<bool> needed(g.size(), false);
+        for (auto & d : diagnostics) {
+            for (auto patch = patch_of(blame_index.blame(d.line)); patch != 0 && !needed[patch]; patch = g.dependencies(patch).front()) {
+                needed[patch] = true;
+            }
+        }
+        std::vector<std::string> edits(g.size());
+        auto view = present;
+        for (auto patch = g.size() - 1; patch != 0; patch--) {
+            if (needed[patch]) {
+                std::ostringstream os;
+                log_edit(os, patch-1, view);
+                edits[patch] = os.str();
+            }
+        }
+
+        for (auto & d : diagnostics) {
+            if (d.message.length() == 0) {
                 std::cout << "An error has occured" << std::endl;
             } else {
-                std::cout << message << std::endl;
+                std::cout << d.message << std::endl;
             }
-            auto line = info.line_;
-            auto column = info.column_;
-            print_lines(line, column);
-            info.cursor_ = cursor;
-            info.updateLineInfo();
+            print_lines(std::cout, d.line, d.column, present.lines(), [&](std::size_t l) { return present.line_str(l); });
             std::cout << "printing backtrace..." << std::endl;
-        }
-        auto begin = g.begin();
-        auto end = g.end();
-        bool target_edit_found = false;
-        LOOP:
-        if (begin != end) {
-            end--;
-            auto pair = *end;
-            auto begin = pair.second.v1.begin();
-            if (begin == pair.second.v1.end()) {
-                goto LOOP;
-            }
-            if (!target_edit_found) {
-                auto edit = stack.get_index(pair.first.additional_data-1);
-                if (edit == nullptr) {
-                    goto LOOP;
-                }
-                bool inverted = edit->is_inverted();
-                const typename Info::UndoInfo * u = static_cast<const typename Info::UndoInfo*>(inverted ? edit->get_command() : edit);
-                if (info.line_ >= u->line) {
-                    auto hunk = DarcsPatch::makeHunk<T, adapter_t>(u->line, u->old_lines, u->new_lines);
-                    if(inverted) {
-                        hunk = hunk->invert();
-                    }
-                    auto fp = std::static_pointer_cast<DarcsPatch::FileHunk<T, adapter_t>>(hunk);
-                    if (info.line_ < u->line + fp->new_lines.size()) {
-                        target_edit_found = true;
-                    } else {
-                        goto LOOP;
-                    }
-                } else {
-                    goto LOOP;
-                }
+            auto end = blame_index.blame(d.line);
+            if (end == 0) {
+                continue;
             }
-            std::cout << " edit #" << std::to_string(pair.first.additional_data) << ":";
-            auto saved = info.cursor_;
-            auto k = log_edit(pair.first.additional_data-1);
-            LOOP_START:
-            std::cout << " edit #" << std::to_string(begin->additional_data) << ":";
-            if (begin->additional_data == 0) {
-                std::cout << " ADD FILE" << std::endl;
-            } else {
-                log_edit(begin->additional_data-1);
-                for(auto & pair2 : g) {
-                    auto begin2 = pair2.second.v1.begin();
-                    if (begin2 != pair2.second.v1.end()) {
-                        if (begin->name == pair2.first.name) {
-                            begin = begin2;
-                            goto LOOP_START;
-                        }
-                    }
+            if (end <= squashed_edits) {
+                std::cout << " edit #" << std::to_string(end) << ": SQUASHED" << std::endl;
+                std::cout << "end of backtrace" << std::endl;
+                continue;
+            }
+            auto patch = patch_of(end);
+            while (true) {
+                std::cout << " edit #" << std::to_string(patches[patch].edit) << ":";
+                if (patch == 0) {
+                    std::cout << " ADD FILE" << std::endl;
+                    break;
                 }
+                std::cout << edits[patch];
+                patch = g.dependencies(patch).front();
             }
             std::cout << "end of backtrace" << std::endl;
-            if (k.has_value()) {
-                stack.redo_to_index(k.value(), &info);
-            }
         }
-        info.seek(cursor);
     }
 
     MINIDOC_TEMPLATE_IMPL
@@ -1590,10 +3230,128 @@ namespace MiniDoc {
         error("");
     }
 
+    MINIDOC_TEMPLATE_IMPL
+    std::size_t MINIDOC_TEMPLATE_DEF::blame(std::size_t line) const {
+        update_patches();
+        return blame_index.blame(line);
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::vector<std::size_t> MINIDOC_TEMPLATE_DEF::blame(std::size_t line, std::size_t count) const {
+        update_patches();
+        return blame_index.blame(line, count);
+    }
+
     MINIDOC_TEMPLATE_IMPL
     void MINIDOC_TEMPLATE_DEF::error(const std::string & message) const {
-        auto graph = DarcsPatch::depsGraph<T, adapter_t>(build_patch_list());
-        renderDepsGraphAsBacktrace(graph, message);
+        update_patches();
+        renderDepsGraphAsBacktrace(graph, { { info->line_, info->column_, message } });
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    const PatchGraph & MINIDOC_TEMPLATE_DEF::patch_graph() const {
+        return graph;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    void MINIDOC_TEMPLATE_DEF::error_batch(const std::vector<Diagnostic> & diagnostics) const {
+        update_patches();
+        renderDepsGraphAsBacktrace(graph, diagnostics);
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    std::vector<std::size_t> MINIDOC_TEMPLATE_DEF::edit_dependents(std::size_t edit) const {
+        update_patches();
+        if (edit <= squashed_edits || edit - squashed_edits >= graph.size()) {
+            throw std::runtime_error("no such edit");
+        }
+        auto dependents = graph.dependents(edit - squashed_edits);
+        for (auto & dependent : dependents) {
+            dependent += squashed_edits;
+        }
+        return dependents;
+    }
+
+    MINIDOC_TEMPLATE_IMPL
+    bool MINIDOC_TEMPLATE_DEF::undo_edit(std::size_t edit) {
+        using LAST_OP = typename Info::LAST_OP;
+
+        update_patches();
+        if (edit <= squashed_edits || edit - squashed_edits >= graph.size()) {
+            throw std::runtime_error("no such edit");
+        }
+        edit -= squashed_edits;
+        if (graph.dependents(edit).size() != 0) {
+            return false;
+        }
+
+        // hunks commute line by line, so edit may still share a line with a later edit
+        //  its text is commuted past them in characters, where they must be apart
+        auto span = edit_spans[edit];
+        for (std::size_t later = edit + 1; later < graph.size(); later++) {
+            auto & p = edit_spans[later];
+            if (p.pos + p.old_length < span.pos) {
+                // p is before the text of edit, which moves by the characters p added
+                span.pos = span.pos + p.new_length - p.old_length;
+            } else if (span.pos + span.new_length >= p.pos) {
+                return false;
+            }
+        }
+
+        // the text edit replaced, only this record is read from the history
+        auto cmd = stack.get_index(edit - 1);
+        bool inverted = cmd->is_inverted();
+        const typename Info::UndoInfo * u = static_cast<const typename Info::UndoInfo*>(inverted ? cmd->get_command() : cmd);
+        typename Info::Spans old_text;
+        if (inverted) {
+            if (u->op == LAST_OP::LAST_OP_INSERT) {
+                old_text = u->content;
+            } else if (u->op == LAST_OP::LAST_OP_REPLACE) {
+                old_text = u->content2;
+            }
+        } else if (u->op != LAST_OP::LAST_OP_INSERT) {
+            old_text = u->content;
+        }
+
+        // the inverse is recorded as commit records an edit, and is never coalesced with the edits around it
+        //  the old text is reinstated from the buffers it is still in, see insert_spans
+        typename Info::UndoInfo undo_info;
+        undo_info.owner = info.get();
+        undo_info.buffer = info->piece.last_buffer;
+        undo_info.insert_position_start = span.pos;
+        undo_info.replace_position_start = span.pos;
+        undo_info.erase_position_start = span.pos;
+        undo_info.replace_length = 0;
+        undo_info.erase_length = 0;
+        undo_info.content2_length = 0;
+        auto erased = info->piece.range_spans(span.pos, span.new_length);
+        if (span.old_length == 0) {
+            undo_info.op = LAST_OP::LAST_OP_ERASE;
+            undo_info.erase_length = span.new_length;
+            undo_info.content = std::move(erased);
+            undo_info.content_length = span.new_length;
+            info->piece.erase(span.pos, span.new_length);
+        } else if (span.new_length == 0) {
+            undo_info.op = LAST_OP::LAST_OP_INSERT;
+            info->piece.insert_spans(old_text, span.pos);
+            undo_info.content = std::move(old_text);
+            undo_info.content_length = span.old_length;
+        } else {
+            undo_info.op = LAST_OP::LAST_OP_REPLACE;
+            undo_info.replace_length = span.new_length;
+            undo_info.content = std::move(erased);
+            undo_info.content_length = span.new_length;
+            info->piece.replace_spans(old_text, span.pos, span.new_length);
+            undo_info.content2 = std::move(old_text);
+            undo_info.content2_length = span.old_length;
+        }
+        info->updateLineInfo();
+        undo_info.line = 0;
+        undo_info.old_lines = 0;
+        undo_info.new_lines = 0;
+        info->record_patch(&undo_info);
+        push_edit(std::move(undo_info), false);
+        return true;
     }
 }
 
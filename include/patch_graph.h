@@ -0,0 +1,478 @@
+#ifndef MINIDOC_PATCH_GRAPH_H
+#define MINIDOC_PATCH_GRAPH_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <limits>
+
+namespace MiniDoc {
+
+  // a hunk replaces old_lines lines starting at line with new_lines lines
+  struct HunkShape {
+    std::size_t line = 0;
+    std::size_t old_lines = 0;
+    std::size_t new_lines = 0;
+
+    HunkShape invert() const {
+      return { line, new_lines, old_lines };
+    }
+
+    bool operator==(const HunkShape & other) const {
+      return line == other.line && old_lines == other.old_lines && new_lines == other.new_lines;
+    }
+  };
+
+  /*
+     commutes first :> second into second' :> first', the rules of darcs hunk commutation
+
+     hunks that are apart in line space commute, the later one is shifted by the lines the earlier one added
+      hunks that overlap, or touch where either is empty, depend on each other and are left unchanged
+  */
+  inline bool commute_hunks(HunkShape & first, HunkShape & second) {
+    bool non_empty = first.old_lines != 0 && first.new_lines != 0 && second.old_lines != 0 && second.new_lines != 0;
+    if (first.line + first.new_lines < second.line || (non_empty && first.line + first.new_lines == second.line)) {
+      second.line = second.line - first.new_lines + first.old_lines;
+      return true;
+    }
+    if (second.line + second.old_lines < first.line || (non_empty && second.line + second.old_lines == first.line)) {
+      first.line = first.line + second.new_lines - second.old_lines;
+      return true;
+    }
+    return false;
+  }
+
+  /*
+     the dependency graph of a patch sequence, patch 0 adds the file and every later patch is a hunk
+
+     the graph is extended one patch at a time, the dependencies of a new patch are found as darcs depsGraph
+      finds them, the patch is commuted backwards past every earlier patch it is independent of,
+      an earlier patch it cannot pass is a direct dependency, and everything that patch depends on is an indirect one
+
+     earlier patches are never visited again, so a patch costs the same whenever its dependencies are asked for
+
+     the dependencies of a patch only follow from its hunk and the hunks before it, so the patches a truncate drops are kept
+      and pushing the same hunks again in the same order, such as redoing what was undone, reuses their commute results
+
+
+     a walk keeps the lines the block touches as an interval, in the lines of the document just after the patch being passed
+      a patch wholly before or after that interval commutes past the whole block, and is passed without a commute attempt
+
+     the patches are indexed in aligned runs of run_size, 2 * run_size, 4 * run_size and so on
+      a run keeps the stretches of lines, in the lines just after its last patch, that touch none of its patches
+      and how far a line in each stretch moves once it is back before the run
+      an interval inside one stretch passes the whole run at once, so a walk only stops at the patches near its interval
+      and at those the block carries, a lookup per run of a size
+
+     a batch of patches can be pushed by several threads, each walks one patch at a time in patch order
+      the walk of a patch only reads the dependencies of an earlier patch it cannot pass, and waits for them if they are not found yet
+      so the graph is the same as pushing the patches one by one
+  */
+  class PatchGraph {
+    struct Node {
+      HunkShape shape;
+      // ascending
+      std::vector<std::size_t> direct;
+      // the later patches that have this one as a direct dependency, ascending
+      std::vector<std::size_t> dependents;
+    };
+
+    std::vector<Node> nodes;
+
+    // lines lo to hi, that move by shift once past a run of patches
+    struct Gap {
+      int64_t lo;
+      int64_t hi;
+      int64_t shift;
+    };
+
+    static constexpr int64_t unbounded = std::numeric_limits<int64_t>::max();
+
+    // lines that are not a line of the document stay where they are
+    static int64_t move(int64_t line, int64_t by) {
+      return line == unbounded || line == -unbounded ? line : line + by;
+    }
+
+    static constexpr std::size_t run_size = 16;
+
+    // runs[k][j] holds the stretches of patches 1 + j * (run_size << k) to (j + 1) * (run_size << k), ascending
+    std::vector<std::vector<std::vector<Gap>>> runs;
+
+    // the state of one walk back through the patches, one per thread
+    struct Walker {
+      // marks the indirect dependencies of the patch being pushed
+      std::vector<uint64_t> marks;
+      uint64_t stamp = 0;
+
+      // the patch being pushed together with the dependencies it carries, the latest is at the front
+      std::vector<HunkShape> block;
+      // the patches of the block as they were before a commute was attempted
+      std::vector<HunkShape> scratch;
+      std::vector<std::size_t> walk;
+
+      // no patch of the block touches a line outside [lo, hi]
+      int64_t lo = 0;
+      int64_t hi = 0;
+      // added to the lines of the block when it is next commuted patch by patch, wraps around like the lines
+      std::size_t shift = 0;
+
+      // the marked patches not reached yet, a heap with the latest at the front
+      std::vector<std::size_t> pending;
+
+      std::size_t attempts = 0;
+
+      // adds the patch before the block to it
+      void extend(const HunkShape & earlier) {
+        // the lines of the block move by at most the lines earlier inserts or removes
+        lo = std::min<int64_t>(lo - (int64_t)earlier.new_lines, (int64_t)earlier.line);
+        hi = std::max<int64_t>(hi + (int64_t)earlier.old_lines, (int64_t)(earlier.line + earlier.old_lines));
+        block.push_back({ earlier.line - shift, earlier.old_lines, earlier.new_lines });
+      }
+
+      void apply_shift() {
+        for (auto & shape : block) {
+          shape.line += shift;
+        }
+        shift = 0;
+      }
+
+      // the interval of the block found again, once it is shifted
+      void bound() {
+        lo = (int64_t)block[0].line;
+        hi = (int64_t)(block[0].line + block[0].old_lines);
+        for (std::size_t k = 1; k < block.size(); k++) {
+          lo = std::min<int64_t>(lo - (int64_t)block[k].new_lines, (int64_t)block[k].line);
+          hi = std::max<int64_t>(hi + (int64_t)block[k].old_lines, (int64_t)(block[k].line + block[k].old_lines));
+        }
+      }
+    };
+
+    Walker walker;
+
+    // the patches dropped by truncate that may follow the current ones, the next patch is at the back
+    std::vector<Node> dropped;
+    std::size_t pushes = 0;
+    std::size_t reused = 0;
+
+    // smaller batches are pushed on the calling thread
+    static constexpr std::size_t parallel_batch = 1024;
+
+    // wait(q) returns once the dependencies of patch q are found
+    template <typename Wait>
+    void mark_dependencies(std::size_t patch, Walker & w, const Wait & wait) {
+      w.walk.assign(nodes[patch].direct.begin(), nodes[patch].direct.end());
+      while (w.walk.size() != 0) {
+        auto next = w.walk.back();
+        w.walk.pop_back();
+        if (w.marks[next] == w.stamp) {
+          continue;
+        }
+        w.marks[next] = w.stamp;
+        w.pending.push_back(next);
+        std::push_heap(w.pending.begin(), w.pending.end());
+        wait(next);
+        w.walk.insert(w.walk.end(), nodes[next].direct.begin(), nodes[next].direct.end());
+      }
+    }
+
+    // the stretches of the run later followed by the run earlier just before it
+    static std::vector<Gap> join(const std::vector<Gap> & later, const std::vector<Gap> & earlier) {
+      std::vector<Gap> gaps;
+      std::size_t k = 0;
+      for (auto & gap : later) {
+        // where the stretch lies just before the later run
+        auto lo = move(gap.lo, gap.shift);
+        auto hi = move(gap.hi, gap.shift);
+        while (k < earlier.size() && earlier[k].hi < lo) {
+          k++;
+        }
+        for (auto j = k; j < earlier.size() && earlier[j].lo <= hi; j++) {
+          gaps.push_back({ std::max(gap.lo, move(earlier[j].lo, -gap.shift)), std::min(gap.hi, move(earlier[j].hi, -gap.shift)), gap.shift + earlier[j].shift });
+        }
+      }
+      return gaps;
+    }
+
+    // the stretches of a run of one patch, the lines before it and the lines after it
+    std::vector<Gap> stretches(std::size_t patch) const {
+      auto & shape = nodes[patch].shape;
+      return {
+        { -unbounded, (int64_t)shape.line - 1, 0 },
+        { (int64_t)(shape.line + shape.new_lines) + 1, unbounded, (int64_t)shape.old_lines - (int64_t)shape.new_lines }
+      };
+    }
+
+    // indexes the runs that patch is the last patch of, every earlier patch is indexed
+    void index(std::size_t patch) {
+      if (patch % run_size != 0) {
+        return;
+      }
+      if (runs.size() == 0) {
+        runs.emplace_back();
+      }
+      auto gaps = stretches(patch);
+      for (auto q = patch - 1; q > patch - run_size; q--) {
+        gaps = join(gaps, stretches(q));
+      }
+      runs[0].push_back(std::move(gaps));
+      // a run of each size ends here while the runs of the size below pair up
+      for (std::size_t k = 0; runs[k].size() % 2 == 0; k++) {
+        if (runs.size() == k + 1) {
+          runs.emplace_back();
+        }
+        auto & level = runs[k];
+        runs[k + 1].push_back(join(level[level.size() - 1], level[level.size() - 2]));
+      }
+    }
+
+    // passes the longest run of patches ending at q, all later than floor, that the interval of the block is inside a stretch of
+    //  returns the patches passed, none if there is no such run
+    std::size_t pass(std::size_t q, std::size_t floor, Walker & w) const {
+      for (auto k = runs.size(); k-- != 0;) {
+        auto length = run_size << k;
+        if (q % length != 0 || q - length < floor || q / length > runs[k].size()) {
+          continue;
+        }
+        auto & gaps = runs[k][q / length - 1];
+        auto gap = std::lower_bound(gaps.begin(), gaps.end(), w.lo, [](const Gap & gap, int64_t line) { return gap.hi < line; });
+        if (gap == gaps.end() || gap->lo > w.lo || gap->hi < w.hi) {
+          continue;
+        }
+        w.shift += (std::size_t)gap->shift;
+        w.lo += gap->shift;
+        w.hi += gap->shift;
+        return length;
+      }
+      return 0;
+    }
+
+    // finds the dependencies of patch, whose shape is set
+    template <typename Wait>
+    void find_dependencies(std::size_t patch, Walker & w, const Wait & wait) {
+      w.stamp++;
+      w.pending.clear();
+      auto & direct = nodes[patch].direct;
+      w.block.assign(1, nodes[patch].shape);
+      w.shift = 0;
+      w.bound();
+      for (std::size_t q = patch - 1; q != 0; q--) {
+        if (w.marks[q] == w.stamp) {
+          // already depended upon, it travels with the block
+          std::pop_heap(w.pending.begin(), w.pending.end());
+          w.pending.pop_back();
+          w.extend(nodes[q].shape);
+          continue;
+        }
+        // the patches down to the next marked one are passed a run at a time while the block is clear of them
+        auto passed = pass(q, w.pending.size() == 0 ? 0 : w.pending.front(), w);
+        if (passed != 0) {
+          q -= passed - 1;
+          continue;
+        }
+        auto moving = nodes[q].shape;
+        if ((int64_t)(moving.line + moving.new_lines) < w.lo) {
+          // q is before every patch of the block, which moves back by the lines q added
+          auto delta = (int64_t)moving.old_lines - (int64_t)moving.new_lines;
+          w.shift += moving.old_lines - moving.new_lines;
+          w.lo += delta;
+          w.hi += delta;
+          continue;
+        }
+        if ((int64_t)moving.line > w.hi) {
+          // q is after every patch of the block, which is left as it is
+          continue;
+        }
+        // q moves past the whole block, from the earliest patch of the block to the latest
+        //  the patches it moved past are put back if it is stopped
+        w.apply_shift();
+        w.scratch.clear();
+        bool commutes = true;
+        for (auto it = w.block.rbegin(); it != w.block.rend(); it++) {
+          w.scratch.push_back(*it);
+          w.attempts++;
+          if (!commute_hunks(moving, *it)) {
+            commutes = false;
+            std::copy(w.scratch.begin(), w.scratch.end(), w.block.rbegin());
+            break;
+          }
+        }
+        if (!commutes) {
+          direct.push_back(q);
+          wait(q);
+          mark_dependencies(q, w, wait);
+          w.extend(nodes[q].shape);
+        } else {
+          w.bound();
+        }
+      }
+      // a hunk never commutes with the patch that adds its file
+      if (w.marks[0] != w.stamp) {
+        direct.push_back(0);
+      }
+      std::reverse(direct.begin(), direct.end());
+    }
+
+    void add_dependents(std::size_t patch) {
+      for (auto dependency : nodes[patch].direct) {
+        nodes[dependency].dependents.push_back(patch);
+      }
+    }
+
+    public:
+
+    PatchGraph() {
+      nodes.emplace_back();
+      walker.marks.push_back(0);
+    }
+
+    // the number of patches, including the add file patch
+    std::size_t size() const {
+      return nodes.size();
+    }
+
+    // drops every patch from size on, the add file patch is always kept
+    void truncate(std::size_t size) {
+      size = std::max<std::size_t>(size, 1);
+      while (nodes.size() > size) {
+        // the patch is the latest dependent of each of its dependencies
+        for (auto dependency : nodes.back().direct) {
+          nodes[dependency].dependents.pop_back();
+        }
+        nodes.back().dependents.clear();
+        dropped.push_back(std::move(nodes.back()));
+        nodes.pop_back();
+      }
+      walker.marks.resize(nodes.size());
+      // the runs that reach a dropped patch
+      for (std::size_t k = 0; k < runs.size(); k++) {
+        runs[k].resize(std::min(runs[k].size(), (nodes.size() - 1) / (run_size << k)));
+      }
+    }
+
+    void push(const HunkShape & shape) {
+      std::size_t patch = nodes.size();
+      walker.marks.push_back(0);
+      pushes++;
+      if (dropped.size() != 0 && dropped.back().shape == shape) {
+        reused++;
+        nodes.push_back(std::move(dropped.back()));
+        dropped.pop_back();
+        index(patch);
+        add_dependents(patch);
+        return;
+      }
+      // the hunks no longer follow the dropped ones
+      dropped.clear();
+      nodes.push_back({ shape, {}, {} });
+      index(patch);
+      find_dependencies(patch, walker, [](std::size_t) {});
+      add_dependents(patch);
+    }
+
+    // pushes shapes in order, the walks are shared among up to threads threads when there are enough of them
+    void push(const std::vector<HunkShape> & shapes, std::size_t threads) {
+      std::size_t i = 0;
+      while (i < shapes.size() && dropped.size() != 0 && dropped.back().shape == shapes[i]) {
+        push(shapes[i]);
+        i++;
+      }
+      if (threads <= 1 || shapes.size() - i < parallel_batch) {
+        for (; i < shapes.size(); i++) {
+          push(shapes[i]);
+        }
+        return;
+      }
+      dropped.clear();
+      pushes += shapes.size() - i;
+
+      auto first = nodes.size();
+      for (; i < shapes.size(); i++) {
+        nodes.push_back({ shapes[i], {}, {} });
+        index(nodes.size() - 1);
+      }
+      walker.marks.resize(nodes.size());
+      // nodes is not resized until every walk is done, a walk only writes the dependencies of its own patch
+      std::unique_ptr<std::atomic<bool>[]> found(new std::atomic<bool>[nodes.size() - first]);
+      for (std::size_t patch = first; patch < nodes.size(); patch++) {
+        found[patch - first].store(false, std::memory_order_relaxed);
+      }
+      auto wait = [&](std::size_t q) {
+        if (q < first) {
+          return;
+        }
+        while (!found[q - first].load(std::memory_order_acquire)) {
+          std::this_thread::yield();
+        }
+      };
+      // patches are taken in order, the earliest patch not found yet never waits, so every walk finishes
+      std::atomic<std::size_t> next { first };
+      auto work = [&](Walker & w) {
+        w.marks.assign(nodes.size(), 0);
+        while (true) {
+          auto patch = next.fetch_add(1);
+          if (patch >= nodes.size()) {
+            break;
+          }
+          find_dependencies(patch, w, wait);
+          found[patch - first].store(true, std::memory_order_release);
+        }
+      };
+
+      threads = std::min(threads, nodes.size() - first);
+      std::vector<Walker> walkers(threads - 1);
+      std::vector<std::thread> pool;
+      for (auto & w : walkers) {
+        pool.emplace_back(work, std::ref(w));
+      }
+      work(walker);
+      for (auto & thread : pool) {
+        thread.join();
+      }
+      for (auto & w : walkers) {
+        walker.attempts += w.attempts;
+      }
+      for (std::size_t patch = first; patch < nodes.size(); patch++) {
+        add_dependents(patch);
+      }
+      walker.marks.resize(nodes.size());
+    }
+
+    // the patches that patch cannot be commuted past directly, ascending, empty for the add file patch
+    const std::vector<std::size_t> & dependencies(std::size_t patch) const {
+      return nodes[patch].direct;
+    }
+
+    // the later patches that have patch as a direct dependency, ascending
+    //  a patch can be commuted past every later patch only if it has none
+    const std::vector<std::size_t> & dependents(std::size_t patch) const {
+      return nodes[patch].dependents;
+    }
+
+    const HunkShape & shape(std::size_t patch) const {
+      return nodes[patch].shape;
+    }
+
+    // the patches pushed, and those of them whose commute results were reused rather than found again
+    std::size_t pushed() const {
+      return pushes;
+    }
+
+    std::size_t memo_hits() const {
+      return reused;
+    }
+
+    // the commutes of two hunks attempted while finding dependencies
+    std::size_t commutes() const {
+      return walker.attempts;
+    }
+
+    // the share of pushed patches that were reused, zero before the first push
+    double memo_hit_rate() const {
+      return pushes == 0 ? 0.0 : (double)reused / (double)pushes;
+    }
+  };
+}
+#endif
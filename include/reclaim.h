@@ -0,0 +1,111 @@
+#ifndef MINIDOC_RECLAIM_H
+#define MINIDOC_RECLAIM_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+
+namespace MiniDoc {
+
+  /*
+     destroys retired objects on a background thread, so dropping a large history or document
+      does not stall the thread that drops it
+
+     a retired object is moved into the reclaimer, nothing may refer to it afterwards
+      and its destructor must be safe to run on another thread
+
+     the thread is started by the first retire, and is joined once every retired object is destroyed
+  */
+  class Reclaimer {
+    struct Retired {
+      virtual ~Retired() = default;
+    };
+
+    template <typename O>
+    struct Holder : Retired {
+      O object;
+
+      Holder(O && object) : object(std::move(object)) {}
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::vector<std::unique_ptr<Retired>> queue;
+    // objects taken off the queue and not yet destroyed
+    std::size_t destroying = 0;
+    bool stopping = false;
+    std::thread thread;
+
+    void run() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        wake.wait(lock, [this] { return stopping || queue.size() != 0; });
+        if (queue.size() == 0) {
+          return;
+        }
+        std::vector<std::unique_ptr<Retired>> batch;
+        batch.swap(queue);
+        destroying = batch.size();
+        lock.unlock();
+        batch.clear();
+        lock.lock();
+        destroying = 0;
+        idle.notify_all();
+      }
+    }
+
+    public:
+
+    Reclaimer() = default;
+    Reclaimer(const Reclaimer &) = delete;
+    Reclaimer & operator=(const Reclaimer &) = delete;
+
+    ~Reclaimer() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_one();
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+
+    template <typename O>
+    void retire(O && object) {
+      static_assert(!std::is_lvalue_reference<O>::value, "retire takes ownership, move the object in");
+      std::unique_ptr<Retired> retired(new Holder<O>(std::move(object)));
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(retired));
+        if (!thread.joinable()) {
+          thread = std::thread([this] { run(); });
+        }
+      }
+      wake.notify_one();
+    }
+
+    // the objects retired and not yet destroyed
+    std::size_t pending() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return queue.size() + destroying;
+    }
+
+    // blocks until every object retired so far is destroyed
+    void drain() {
+      std::unique_lock<std::mutex> lock(mutex);
+      idle.wait(lock, [this] { return queue.size() == 0 && destroying == 0; });
+    }
+
+    // a reclaimer shared by every document, its thread is joined at exit
+    static Reclaimer & shared() {
+      static Reclaimer reclaimer;
+      return reclaimer;
+    }
+  };
+}
+#endif
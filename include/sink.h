@@ -0,0 +1,85 @@
+#ifndef MINIDOC_SINK_H
+#define MINIDOC_SINK_H
+
+#include <string>
+#include <functional>
+#include <ostream>
+#include <cstdint>
+
+namespace MiniDoc {
+
+  // receives exported text, in pieces of any size
+  using Sink = std::function<void(const char * data, std::size_t length)>;
+
+  /*
+     collects many small writes in a buffer and hands them to a sink in pieces of about capacity bytes
+
+     whatever is left in the buffer is only handed over by flush, the writer does not flush when it is destroyed
+      so an exception thrown by the sink reaches the caller of write or flush
+  */
+  class BufferedSink {
+    Sink sink;
+    std::string buffer;
+    std::size_t capacity;
+
+    public:
+
+    static constexpr std::size_t default_capacity = 1 << 16;
+
+    BufferedSink(Sink sink, std::size_t capacity = default_capacity) : sink(std::move(sink)), capacity(capacity) {
+      buffer.reserve(capacity);
+    }
+
+    // a sink that writes to os, which must outlive it
+    static Sink to(std::ostream & os) {
+      return [&os](const char * data, std::size_t length) { os.write(data, length); };
+    }
+
+    BufferedSink & write(const char * data, std::size_t length) {
+      if (buffer.size() + length > capacity) {
+        flush();
+        if (length > capacity) {
+          sink(data, length);
+          return *this;
+        }
+      }
+      buffer.append(data, length);
+      return *this;
+    }
+
+    BufferedSink & operator<<(char c) {
+      if (buffer.size() == capacity) {
+        flush();
+      }
+      buffer.push_back(c);
+      return *this;
+    }
+
+    BufferedSink & operator<<(const char * text) {
+      return write(text, std::char_traits<char>::length(text));
+    }
+
+    BufferedSink & operator<<(const std::string & text) {
+      return write(text.data(), text.size());
+    }
+
+    BufferedSink & operator<<(uint64_t number) {
+      char digits[20];
+      std::size_t n = 0;
+      do {
+        digits[sizeof(digits) - 1 - n] = '0' + number % 10;
+        number /= 10;
+        n++;
+      } while (number != 0);
+      return write(digits + sizeof(digits) - n, n);
+    }
+
+    void flush() {
+      if (buffer.size() != 0) {
+        sink(buffer.data(), buffer.size());
+        buffer.clear();
+      }
+    }
+  };
+}
+#endif
@@ -0,0 +1,389 @@
+#ifndef MINIDOC_SPILL_H
+#define MINIDOC_SPILL_H
+
+#include <string>
+#include <istream>
+#include <iterator>
+#include <type_traits>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include "compress.h"
+
+namespace MiniDoc {
+
+  // appends plain values to a byte string, values are written in host byte order
+  struct SpillWriter {
+    std::string bytes;
+
+    template <typename V>
+    void put(const V & value) {
+      static_assert(std::is_trivially_copyable<V>::value, "only trivially copyable values can be spilled");
+      bytes.append(reinterpret_cast<const char*>(&value), sizeof(V));
+    }
+
+    void put_varint(uint64_t value) {
+      MiniDoc::put_varint(bytes, value);
+    }
+
+    // value as a zigzag encoded difference from base, values close to base take a single byte
+    void put_delta(uint64_t value, uint64_t base) {
+      auto difference = (int64_t) (value - base);
+      put_varint(((uint64_t) difference << 1) ^ (uint64_t) (difference >> 63));
+    }
+
+    void put_bytes(const void * data, std::size_t length) {
+      bytes.append(reinterpret_cast<const char*>(data), length);
+    }
+  };
+
+  // reads back the values of a SpillWriter in the order they were put
+  struct SpillReader {
+    const std::string & bytes;
+    std::size_t position = 0;
+
+    // handed to the commands read back, see UndoStack::set_spill_context
+    const void * context = nullptr;
+
+    SpillReader(const std::string & bytes) : bytes(bytes) {}
+
+    template <typename V>
+    V get() {
+      static_assert(std::is_trivially_copyable<V>::value, "only trivially copyable values can be spilled");
+      if (position + sizeof(V) > bytes.size()) {
+        throw std::runtime_error("spill record is truncated");
+      }
+      V value;
+      std::memcpy(&value, bytes.data() + position, sizeof(V));
+      position += sizeof(V);
+      return value;
+    }
+
+    uint64_t get_varint() {
+      return MiniDoc::get_varint(bytes, position);
+    }
+
+    uint64_t get_delta(uint64_t base) {
+      auto zigzag = get_varint();
+      auto difference = (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+      return base + difference;
+    }
+
+    // the bytes are not copied, the pointer is valid as long as bytes is
+    const char * get_bytes(std::size_t length) {
+      if (length > bytes.size() - position) {
+        throw std::runtime_error("spill record is truncated");
+      }
+      auto data = bytes.data() + position;
+      position += length;
+      return data;
+    }
+  };
+
+  // reads the values of a SpillWriter straight from a stream, so large inputs are not held twice
+  struct SpillStreamReader {
+    std::istream & is;
+
+    SpillStreamReader(std::istream & is) : is(is) {}
+
+    uint64_t get_varint() {
+      uint64_t value = 0;
+      for (unsigned shift = 0; shift < 64; shift += 7) {
+        auto byte = is.get();
+        if (byte == std::istream::traits_type::eof()) {
+          throw std::runtime_error("varint is truncated");
+        }
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+          return value;
+        }
+      }
+      throw std::runtime_error("varint is too long");
+    }
+
+    // false if the stream ends first
+    bool get_bytes(void * out, std::size_t length) {
+      return length == 0 || is.read(reinterpret_cast<char*>(out), length).gcount() == (std::streamsize) length;
+    }
+
+    // the bytes left in the stream, or the largest value if the stream cannot tell
+    uint64_t remaining() {
+      auto position = is.tellg();
+      if (position == std::istream::pos_type(-1) || !is.seekg(0, std::ios::end)) {
+        is.clear();
+        return (uint64_t) -1;
+      }
+      auto end = is.tellg();
+      is.seekg(position);
+      return (uint64_t) (end - position);
+    }
+
+    // the rest of the stream
+    std::string get_rest() {
+      return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    }
+  };
+
+  /*
+     a scratch file private to this process, records are appended and read back by offset
+
+     the file is removed by the system when it is closed, it is not a persistence format
+  */
+  class SpillFile {
+    FILE * file = nullptr;
+    uint64_t size_ = 0;
+
+    public:
+
+    SpillFile() = default;
+    SpillFile(const SpillFile &) = delete;
+    SpillFile & operator=(const SpillFile &) = delete;
+
+    SpillFile(SpillFile && other) : file(other.file), size_(other.size_) {
+      other.file = nullptr;
+      other.size_ = 0;
+    }
+
+    SpillFile & operator=(SpillFile && other) {
+      std::swap(file, other.file);
+      std::swap(size_, other.size_);
+      return *this;
+    }
+
+    ~SpillFile() {
+      if (file != nullptr) {
+        fclose(file);
+      }
+    }
+
+    uint64_t size() const {
+      return size_;
+    }
+
+    uint64_t write(const std::string & bytes) {
+      auto offset = size_;
+      write_at(offset, bytes);
+      return offset;
+    }
+
+    // overwrites bytes at offset, the file grows if they reach past its end
+    void write_at(uint64_t offset, const std::string & bytes) {
+      if (file == nullptr) {
+        file = tmpfile();
+        if (file == nullptr) {
+          throw std::runtime_error("failed to create the spill file");
+        }
+      }
+      if (fseek(file, (long) offset, SEEK_SET) != 0 || fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) {
+        throw std::runtime_error("failed to write the spill file");
+      }
+      size_ = std::max<uint64_t>(size_, offset + bytes.size());
+    }
+
+    std::string read(uint64_t offset, std::size_t length) const {
+      std::string bytes(length, '\0');
+      if (file == nullptr || fseek(file, (long) offset, SEEK_SET) != 0 || fread(&bytes[0], 1, length, file) != length) {
+        throw std::runtime_error("failed to read the spill file");
+      }
+      return bytes;
+    }
+  };
+
+  enum class ColdStorage {
+    MEMORY,
+    FILE
+  };
+
+  /*
+     cold records are appended to a block, a full block is compressed with LZ
+      and kept in memory or written to a SpillFile
+
+     a record is addressed by its offset in the uncompressed stream of records
+      records never straddle two blocks, the most recently read block is kept decompressed
+
+     a record that is no longer needed is released, a block is dropped once none of its records are live
+      the space a dropped block held in the file is reused by the next blocks that fit in it
+  */
+  class ColdStore {
+    struct Block {
+      uint64_t start;
+      std::size_t raw_length;
+      bool in_file;
+      uint64_t file_offset;
+      std::size_t stored_length;
+      std::string data;
+      // the bytes of the records of the block that are not released
+      std::size_t live;
+    };
+
+    // the ranges of the file left by dropped blocks
+    struct Hole {
+      uint64_t offset;
+      std::size_t length;
+    };
+
+    // ordered by start, dropped blocks are removed
+    std::vector<Block> blocks;
+    std::string pending;
+    uint64_t pending_start = 0;
+    std::size_t pending_live = 0;
+    uint64_t stored_bytes_ = 0;
+    SpillFile file;
+    std::vector<Hole> holes;
+    ColdStorage storage_ = ColdStorage::FILE;
+
+    mutable std::size_t cached_block = -1;
+    mutable std::string cached;
+
+    std::size_t block_size_ = default_block_size;
+
+    void flush() {
+      if (pending.size() == 0) {
+        return;
+      }
+      Block block;
+      block.start = pending_start;
+      block.raw_length = pending.size();
+      auto compressed = LZ::compress(pending);
+      block.stored_length = compressed.size();
+      block.in_file = storage_ == ColdStorage::FILE;
+      block.file_offset = 0;
+      block.live = pending_live;
+      if (block.in_file) {
+        auto hole = std::find_if(holes.begin(), holes.end(), [&](const Hole & hole) { return hole.length >= compressed.size(); });
+        if (hole != holes.end()) {
+          block.file_offset = hole->offset;
+          file.write_at(hole->offset, compressed);
+          hole->offset += compressed.size();
+          hole->length -= compressed.size();
+          if (hole->length == 0) {
+            holes.erase(hole);
+          }
+        } else {
+          block.file_offset = file.write(compressed);
+        }
+      } else {
+        block.data = std::move(compressed);
+      }
+      stored_bytes_ += block.stored_length;
+      pending_start += pending.size();
+      pending.clear();
+      pending_live = 0;
+      blocks.push_back(std::move(block));
+    }
+
+    // holes are kept ordered by offset, a hole is merged with the holes it touches
+    void add_hole(Hole hole) {
+      auto next = std::upper_bound(holes.begin(), holes.end(), hole.offset, [](uint64_t offset, const Hole & hole) { return offset < hole.offset; });
+      if (next != holes.end() && hole.offset + hole.length == next->offset) {
+        hole.length += next->length;
+        next = holes.erase(next);
+      }
+      if (next != holes.begin()) {
+        auto previous = std::prev(next);
+        if (previous->offset + previous->length == hole.offset) {
+          previous->length += hole.length;
+          return;
+        }
+      }
+      holes.insert(next, hole);
+    }
+
+    std::size_t find_block(uint64_t offset) const {
+      return (std::upper_bound(blocks.begin(), blocks.end(), offset, [](uint64_t offset, const Block & block) { return offset < block.start; }) - blocks.begin()) - 1;
+    }
+
+    public:
+
+    static constexpr std::size_t default_block_size = 16 * 1024;
+
+    // the raw bytes of records compressed together, applies to blocks filled from now on
+    //  larger blocks compress better, smaller ones are read back and dropped sooner
+    void set_block_size(std::size_t bytes) {
+      block_size_ = std::max<std::size_t>(bytes, 1);
+    }
+
+    std::size_t block_size() const {
+      return block_size_;
+    }
+
+    // applies to blocks compressed from now on
+    void set_storage(ColdStorage storage) {
+      storage_ = storage;
+    }
+
+    ColdStorage storage() const {
+      return storage_;
+    }
+
+    // the bytes of every record written
+    uint64_t raw_bytes() const {
+      return pending_start + pending.size();
+    }
+
+    // the bytes held for the records, compressed blocks plus the block being filled
+    uint64_t stored_bytes() const {
+      return stored_bytes_ + pending.size();
+    }
+
+    // the size of the spill file, which does not shrink when blocks are dropped
+    uint64_t file_bytes() const {
+      return file.size();
+    }
+
+    uint64_t write(const std::string & record) {
+      auto offset = raw_bytes();
+      pending.append(record);
+      pending_live += record.size();
+      if (pending.size() >= block_size_) {
+        flush();
+      }
+      return offset;
+    }
+
+    // the record at offset will not be read again
+    void release(uint64_t offset, std::size_t length) {
+      if (length == 0) {
+        return;
+      }
+      if (offset >= pending_start) {
+        pending_live -= length;
+        if (pending_live == 0) {
+          // the offsets of the records written next still follow the released ones
+          pending_start += pending.size();
+          pending.clear();
+        }
+        return;
+      }
+      auto index = find_block(offset);
+      auto & block = blocks[index];
+      block.live -= length;
+      if (block.live != 0) {
+        return;
+      }
+      stored_bytes_ -= block.stored_length;
+      if (block.in_file) {
+        add_hole({ block.file_offset, block.stored_length });
+      }
+      blocks.erase(blocks.begin() + index);
+      cached_block = -1;
+    }
+
+    std::string read(uint64_t offset, std::size_t length) const {
+      if (offset >= pending_start) {
+        return pending.substr(offset - pending_start, length);
+      }
+      std::size_t index = find_block(offset);
+      if (index != cached_block) {
+        auto & block = blocks[index];
+        cached = LZ::decompress(block.in_file ? file.read(block.file_offset, block.stored_length) : block.data, block.raw_length);
+        cached_block = index;
+      }
+      return cached.substr(offset - blocks[index].start, length);
+    }
+  };
+}
+#endif
@@ -2,16 +2,118 @@
 #define MINIDOC_UNDO_H
 
 #include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <new>
+#include <cstdint>
+#include <map>
+#include "spill.h"
+#include "reclaim.h"
 #include <darcs_types.h>
 #include <stdio.h>
 
 namespace MiniDoc {
 
+  /*
+     a bump allocator, memory is only given back when the arena is cleared or destroyed
+
+     objects are never moved, the caller is responsible for destroying the objects it constructs
+  */
+  class Arena {
+    struct Block {
+      std::unique_ptr<unsigned char[]> data;
+      std::size_t size;
+      std::size_t used;
+    };
+
+    std::vector<Block> blocks;
+
+    // released objects, keyed by size and alignment
+    std::map<std::pair<std::size_t, std::size_t>, std::vector<void*>> free_list;
+
+    static constexpr std::size_t block_size = 64 * 1024;
+
+    void * bump(Block & block, std::size_t size, std::size_t align) {
+      auto base = reinterpret_cast<std::uintptr_t>(block.data.get());
+      auto start = ((base + block.used + align - 1) & ~(std::uintptr_t)(align - 1)) - base;
+      if (start + size > block.size) {
+        return nullptr;
+      }
+      block.used = start + size;
+      return block.data.get() + start;
+    }
+
+    public:
+
+    void * allocate(std::size_t size, std::size_t align) {
+      auto it = free_list.find({size, align});
+      if (it != free_list.end() && it->second.size() != 0) {
+        auto p = it->second.back();
+        it->second.pop_back();
+        return p;
+      }
+      if (blocks.size() != 0) {
+        auto p = bump(blocks.back(), size, align);
+        if (p != nullptr) {
+          return p;
+        }
+      }
+      auto n = std::max(block_size, size + align);
+      blocks.push_back({std::unique_ptr<unsigned char[]>(new unsigned char[n]), n, 0});
+      return bump(blocks.back(), size, align);
+    }
+
+    // memory handed back here is reused by the next allocation of the same size and alignment
+    void deallocate(void * p, std::size_t size, std::size_t align) {
+      free_list[{size, align}].push_back(p);
+    }
+
+    template <typename C, typename ... Args>
+    C * make(Args && ... args) {
+      return new (allocate(sizeof(C), alignof(C))) C(std::forward<Args>(args)...);
+    }
+
+    std::size_t capacity() const {
+      std::size_t n = 0;
+      for (auto & block : blocks) {
+        n += block.size;
+      }
+      return n;
+    }
+
+    void clear() {
+      free_list.clear();
+      std::vector<Block>().swap(blocks);
+    }
+  };
+
+  /*
+     the history is kept as an undo tree
+
+     every node is a document state, and owns the command that leads to it from its parent
+     an edit adds a child to the current node, so an edit after an undo starts a new branch
+
+     the undo stack is a linearized view of the tree
+      and is the sequence of steps taken through the tree, a step being a node and a direction
+
+     in advanced mode, an edit after an undo replays the redo stack forwards then backwards
+      (see README.md), the steps of the redo stack are written to the step log once
+      and both directions are recorded as runs over those same steps
+
+     with a history budget, the oldest commands are moved to cold storage once the commands
+      in memory exceed the budget, and are read back when they are next needed
+      only commands that support it are spilled, see Command::spill
+      cold commands are compressed in blocks, see ColdStore
+
+     save writes the tree and both stacks out, restore reads them back into cold storage
+      so the commands of a restored history are only rebuilt when they are needed
+
+  */
   template<typename T>
   class UndoStack {
 
     struct InvertableCommand {
-      virtual std::shared_ptr<InvertableCommand> invert(std::shared_ptr<InvertableCommand> & cmd) const = 0;
       virtual const InvertableCommand * get_command() const {
         return this;
       }
@@ -43,25 +145,31 @@ namespace MiniDoc {
       const Command * get_command() const override {
         return this;
       }
-      protected:
-      private:
-      std::shared_ptr<InvertableCommand> invert(std::shared_ptr<InvertableCommand> & cmd) const override {
-        return std::shared_ptr<InvertableCommand>(new InvertCommand(cmd), [](auto * p) { delete p; });
+
+      // the memory held by the command, counted against the history budget
+      virtual std::size_t bytes() const {
+        return 0;
+      }
+
+      // writes the command out so it can be released while it is cold
+      //  a command that returns true must also be constructible from a SpillReader
+      virtual bool spill(SpillWriter & out) const {
+        return false;
       }
     };
 
     private:
 
     struct InvertCommand : public Command {
-      std::shared_ptr<InvertableCommand> cmd;
+      Command * cmd;
 
-      InvertCommand(std::shared_ptr<InvertableCommand> & cmd) : cmd(cmd) {}
+      InvertCommand(Command * cmd) : cmd(cmd) {}
 
       void undo(T * instance) override {
-        static_cast<Command*>(cmd.get())->redo(instance);
+        cmd->redo(instance);
       };
       void redo(T * instance) override {
-        static_cast<Command*>(cmd.get())->undo(instance);
+        cmd->undo(instance);
       }
       std::ostream & to_stream(std::ostream & os, bool is_inverted) const override {
         os << "InvertCommand: ";
@@ -72,169 +180,875 @@ namespace MiniDoc {
         return true;
       }
       const Command * get_command() const override {
-        return static_cast<const Command*>(cmd.get());
+        return cmd;
       }
-      private:
-      std::shared_ptr<InvertableCommand> invert(std::shared_ptr<InvertableCommand> & cmd) const override {
-        return this->cmd;
+    };
+
+    // how to release and rebuild the commands of one type constructed in the arena
+    struct CommandType {
+      std::size_t size;
+      std::size_t align;
+      // nullptr if the command cannot be read back from the spill file
+      Command * (*rebuild)(Arena & arena, SpillReader & in);
+      // moves the contents of a dropped command to the reclaimer, nullptr if the command cannot be moved
+      void (*retire)(Reclaimer & reclaimer, Command * command);
+    };
+
+    template <typename C>
+    static Command * rebuild_command(Arena & arena, SpillReader & in) {
+      return arena.template make<C>(in);
+    }
+
+    template <typename C>
+    static void retire_command(Reclaimer & reclaimer, Command * command) {
+      reclaimer.retire(std::move(*static_cast<C*>(command)));
+    }
+
+    template <typename C>
+    static const CommandType * command_type() {
+      Command * (*rebuild)(Arena & arena, SpillReader & in) = nullptr;
+      if constexpr (std::is_constructible<C, SpillReader &>::value) {
+        rebuild = &rebuild_command<C>;
+      }
+      void (*retire)(Reclaimer & reclaimer, Command * command) = nullptr;
+      if constexpr (std::is_move_constructible<C>::value) {
+        retire = &retire_command<C>;
+      }
+      static const CommandType type = { sizeof(C), alignof(C), rebuild, retire };
+      return &type;
+    }
+
+    public:
+
+    class Node {
+      friend UndoStack;
+
+      // commands constructed in the arena are destroyed in place, the arena owns their memory
+      struct Release {
+        bool in_arena;
+
+        void operator()(Command * command) const {
+          if (in_arena) {
+            command->~Command();
+          } else {
+            delete command;
+          }
+        }
+      };
+
+      std::unique_ptr<Command, Release> command_;
+      InvertCommand inverse;
+      Node * parent_;
+      std::vector<Node*> children;
+      std::size_t depth_;
+      // position in the node list, the root is 0 and a parent always precedes its children
+      std::size_t index = 0;
+
+      // nullptr for commands that are not in the arena
+      const CommandType * type;
+      // the bytes counted against the history budget while the command is in memory
+      std::size_t bytes = 0;
+      // where the command was spilled, a length of zero if the spill file holds no current copy
+      uint64_t spill_offset = 0;
+      std::size_t spill_length = 0;
+
+      public:
+
+      Node(Command * command, const CommandType * type, Node * parent) : command_(command, Release{type != nullptr}), inverse(command), parent_(parent), depth_(parent == nullptr ? 0 : parent->depth_ + 1), type(type) {}
+
+      // the command that leads from the parent to this node if it is in memory
+      //  nullptr for the root, and while the command is spilled, UndoStack::command reads it back
+      const Command * resident_command() const {
+        return command_.get();
+      }
+
+      // nullptr for the root
+      const Node * parent() const {
+        return parent_;
+      }
+
+      // children are in the order they were created
+      std::size_t child_count() const {
+        return children.size();
+      }
+
+      const Node * child(std::size_t index) const {
+        return index < children.size() ? children[index] : nullptr;
+      }
+
+      std::size_t depth() const {
+        return depth_;
       }
     };
 
-    using STACK = std::vector<std::shared_ptr<InvertableCommand>>;
+    private:
+
+    // a step through the tree, a step that is not inverted moves from the parent of node to node
+    struct Step {
+      Node * node;
+      bool inverted;
+
+      Step invert() const {
+        return {node, !inverted};
+      }
+
+      bool operator==(const Step & other) const {
+        return node == other.node && inverted == other.inverted;
+      }
+    };
+
+    // a range of the step log, an inverted run reads the range back to front with every step inverted
+    struct Run {
+      std::size_t begin;
+      std::size_t end;
+      bool inverted;
+    };
+
+    struct Tree {
+      // must outlive the nodes
+      Arena arena;
+
+      // nodes are never moved, the root is always the first node
+      std::deque<Node> nodes;
+
+      Tree() = default;
+      Tree(Tree && other) = default;
+
+      Tree & operator=(Tree && other) {
+        // the old nodes are destroyed before the arena that holds their commands
+        nodes.clear();
+        arena = std::move(other.arena);
+        nodes = std::move(other.nodes);
+        return *this;
+      }
+    };
+
+    // commands are read back into the arena from const accessors
+    mutable Tree tree;
+
+    std::size_t history_budget = 0;
+    mutable std::size_t resident_bytes = 0;
+    // spillable nodes in the order their commands were last brought into memory
+    mutable std::deque<Node*> resident;
+    mutable ColdStore cold;
+    Node * current_;
+    const T * spill_context = nullptr;
+    Reclaimer * reclaimer = nullptr;
+
+    // the step log is append only, runs may share steps
+    std::vector<Step> log;
+    std::vector<Run> runs;
+    // index of the first undo stack entry of each run, for random access
+    std::vector<std::size_t> run_offsets;
+    std::size_t undo_size = 0;
+    // the undo stack entries below this index are unchanged since the last settle
+    mutable std::size_t settled_ = 0;
+
+    std::vector<Step> redo_stack;
+
+    // nothing has been undone or redone since the last push
+    bool mergeable_ = false;
+
+    // the nodes with more than one child, while there are none the history is a single branch
+    //  and the nodes past the current one are the ones that can be redone, see drop_unreachable
+    std::size_t branches_ = 0;
 
-    STACK undo_stack;
-    STACK redo_stack;
-    
     public:
 
     bool supports_redo = true;
     bool supports_advanced_undo = true;
-    
-    std::size_t undoSize() {
-        return undo_stack.size();
+
+    UndoStack() {
+      tree.nodes.emplace_back(nullptr, nullptr, nullptr);
+      current_ = &tree.nodes.front();
+    }
+
+    UndoStack(UndoStack && other) = default;
+    UndoStack & operator=(UndoStack && other) = default;
+
+    std::size_t undoSize() const {
+        return undo_size;
     }
-    
-    std::size_t redoSize() {
+
+    std::size_t redoSize() const {
         return redo_stack.size();
     }
 
+    const Node * root() const {
+      return &tree.nodes.front();
+    }
+
+    // the node of the current document state
+    const Node * current() const {
+      return current_;
+    }
+
+    // the command that leads from the parent of node to node, read back from cold storage if it is spilled
+    //  nullptr for the root
+    const Command * command(const Node * node) const {
+      if (node->parent_ == nullptr) {
+        return nullptr;
+      }
+      // the nodes are owned by the tree, which is mutable
+      auto n = const_cast<Node*>(node);
+      load(n);
+      return n->command_.get();
+    }
+
+    // the command of the last push, if nothing has been undone or redone since
+    //  the caller may fold a following edit into it instead of pushing a new command
+    Command * mergeable() const {
+      if (!mergeable_) {
+        return nullptr;
+      }
+      load(current_);
+      // the caller may change the command, so a spilled copy is stale
+      cold.release(current_->spill_offset, current_->spill_length);
+      current_->spill_length = 0;
+      settled_ = std::min(settled_, undo_size - 1);
+      return current_->command_.get();
+    }
+
+    // the command of the last push stays on its own, mergeable returns nullptr until the next push
+    void seal() {
+      mergeable_ = false;
+    }
+
     private:
 
-    InvertableCommand & deref(std::shared_ptr<InvertableCommand> & cmd) const {
-      InvertableCommand & ref = *cmd;
-      return ref;
+    Command * command(const Step & step) const {
+      load(step.node);
+      return step.inverted ? static_cast<Command*>(&step.node->inverse) : step.node->command_.get();
     }
 
-    public:
-    
-    void push(Command * command) {
-      // std::cout << "BEFORE PUSH: " << std::endl << *this << std::endl;
-      auto cmd = std::shared_ptr<InvertableCommand>(command, [](auto p) { delete p; });
-      if (supports_redo) {
-        if (!supports_advanced_undo) {
-          // std::cout << "erasing redo stack" << std::endl;
-          redo_stack = {};
-          // std::cout << "erased redo stack" << std::endl;
-        } else {
-          if (redo_stack.size() != 0) {
-            // std::cout << "pushing redo stack to undo stack in reverse order" << std::endl;
-            for (auto i = redo_stack.rbegin(); i != redo_stack.rend(); i++) {
-              auto command2 = *i;
-              // std::cout << "pushing command to undo stack: " << deref(command2) << std::endl;
-              undo_stack.insert(undo_stack.end(), command2);
-            }
-            // std::cout << "pushed redo stack to undo stack in reverse order" << std::endl;
-            // std::cout << "pushing inverted redo stack to undo stack" << std::endl;
-            for (auto i = redo_stack.begin(); i != redo_stack.end(); i++) {
-              auto command2 = i->get()->invert(*i);
-              // std::cout << "pushing command to undo stack: " << deref(command2) << std::endl;
-              undo_stack.insert(undo_stack.end(), command2);
-            }
-            // std::cout << "pushed inverted redo stack to undo stack" << std::endl;
-            // std::cout << "erasing redo stack" << std::endl;
-            redo_stack = {};
-            // std::cout << "erased redo stack" << std::endl;
+    // brings a spilled command back into memory
+    void load(Node * node) const {
+      if (node->command_ || node->parent_ == nullptr) {
+        return;
+      }
+      auto bytes = cold.read(node->spill_offset, node->spill_length);
+      SpillReader in(bytes);
+      in.context = spill_context;
+      auto command = node->type->rebuild(tree.arena, in);
+      node->command_.reset(command);
+      node->inverse.cmd = command;
+      node->bytes = command->bytes();
+      resident_bytes += node->bytes;
+      resident.push_back(node);
+    }
+
+    // spills the commands brought into memory the longest time ago until the budget is met
+    //  the command of the current node is kept, an edit may still be folded into it
+    void enforce_budget() {
+      if (history_budget == 0) {
+        return;
+      }
+      Node * kept = nullptr;
+      while (resident_bytes > history_budget && resident.size() != 0) {
+        Node * node = resident.front();
+        resident.pop_front();
+        if (!node->command_) {
+          continue;
+        }
+        if (node == current_) {
+          kept = node;
+          continue;
+        }
+        if (node->spill_length == 0) {
+          SpillWriter out;
+          if (!node->command_->spill(out)) {
+            // no longer tracked
+            resident_bytes -= node->bytes;
+            node->bytes = 0;
+            continue;
+          }
+          node->spill_offset = cold.write(out.bytes);
+          node->spill_length = out.bytes.size();
+        }
+        Command * command = node->command_.release();
+        command->~Command();
+        tree.arena.deallocate(command, node->type->size, node->type->align);
+        node->inverse.cmd = nullptr;
+        resident_bytes -= node->bytes;
+        node->bytes = 0;
+      }
+      if (kept != nullptr) {
+        resident.push_back(kept);
+      }
+    }
+
+    Step step_at(std::size_t index) const {
+      std::size_t r = (std::upper_bound(run_offsets.begin(), run_offsets.end(), index) - run_offsets.begin()) - 1;
+      auto & run = runs[r];
+      auto offset = index - run_offsets[r];
+      if (run.inverted) {
+        return log[run.end - 1 - offset].invert();
+      }
+      return log[run.begin + offset];
+    }
+
+    Step top() const {
+      auto & run = runs.back();
+      return run.inverted ? log[run.begin].invert() : log[run.end - 1];
+    }
+
+    void pop() {
+      auto & run = runs.back();
+      if (run.inverted) {
+        run.begin++;
+      } else {
+        run.end--;
+      }
+      undo_size--;
+      settled_ = std::min(settled_, undo_size);
+      if (run.begin == run.end) {
+        runs.pop_back();
+        run_offsets.pop_back();
+      }
+    }
+
+    void push_run(std::size_t begin, std::size_t end, bool inverted) {
+      if (begin == end) {
+        return;
+      }
+      run_offsets.push_back(undo_size);
+      runs.push_back({begin, end, inverted});
+      undo_size += end - begin;
+    }
+
+    void push_step(const Step & step) {
+      if (runs.size() == 0 && log.size() != 0 && log[0] == step) {
+        // redoing the first step after everything was undone
+        push_run(0, 1, false);
+        return;
+      }
+      if (runs.size() != 0) {
+        auto & run = runs.back();
+        // stepping back over a step that was just undone reuses the logged step
+        if (run.inverted) {
+          if (run.begin != 0 && log[run.begin - 1] == step.invert()) {
+            run.begin--;
+            undo_size++;
+            return;
           }
+        } else if (run.end != log.size()) {
+          if (log[run.end] == step) {
+            run.end++;
+            undo_size++;
+            return;
+          }
+        } else {
+          log.push_back(step);
+          run.end++;
+          undo_size++;
+          return;
         }
       }
-      // std::cout << "pushing command to undo stack: " << deref(cmd) << std::endl;
-      undo_stack.push_back(cmd);
-      // std::cout << "AFTER PUSH: " << std::endl << *this << std::endl;
+      log.push_back(step);
+      push_run(log.size() - 1, log.size(), false);
+    }
+
+    void undo_step(const Step & step, T * instance) {
+      command(step)->undo(instance);
+      current_ = step.inverted ? step.node : step.node->parent_;
+    }
+
+    void redo_step(const Step & step, T * instance) {
+      command(step)->redo(instance);
+      current_ = step.inverted ? step.node->parent_ : step.node;
+    }
+
+    // destroys the command of a node that is dropped, or hands it to the reclaimer
+    void release(Node & node) {
+      if (!node.command_) {
+        return;
+      }
+      if (node.type == nullptr) {
+        if (reclaimer != nullptr) {
+          reclaimer->retire(std::move(node.command_));
+        }
+        return;
+      }
+      Command * command = node.command_.release();
+      if (reclaimer != nullptr && node.type->retire != nullptr) {
+        // the contents are moved out, the moved from command left in the arena is destroyed here
+        node.type->retire(*reclaimer, command);
+      }
+      command->~Command();
+      tree.arena.deallocate(command, node.type->size, node.type->align);
+    }
+
+    // drops the nodes from index on, the history must be a single branch so that they are its deepest nodes
+    void drop_nodes(std::size_t index) {
+      if (index >= tree.nodes.size()) {
+        return;
+      }
+      resident.erase(std::remove_if(resident.begin(), resident.end(), [index](Node * node) { return node->index >= index; }), resident.end());
+      while (tree.nodes.size() > index) {
+        Node & node = tree.nodes.back();
+        node.parent_->children.pop_back();
+        resident_bytes -= node.bytes;
+        cold.release(node.spill_offset, node.spill_length);
+        release(node);
+        tree.nodes.pop_back();
+      }
+      // the steps past the undo stack only led to the dropped nodes
+      log.resize(runs.size() == 0 ? 0 : runs.back().end);
+    }
+
+    // drops the nodes that can no longer be reached, a history with branches keeps every node
+    void drop_unreachable() {
+      if (branches_ != 0 || redo_stack.size() != 0) {
+        return;
+      }
+      drop_nodes(current_->index + 1);
+    }
+
+    void push(Command * command, const CommandType * type) {
+      if (supports_redo && !supports_advanced_undo) {
+        // the undone steps can no longer be redone
+        redo_stack.clear();
+        drop_unreachable();
+      }
+      tree.nodes.emplace_back(command, type, current_);
+      Node * node = &tree.nodes.back();
+      node->index = tree.nodes.size() - 1;
+      current_->children.push_back(node);
+      if (current_->children.size() == 2) {
+        branches_++;
+      }
+      if (supports_redo && supports_advanced_undo && redo_stack.size() != 0) {
+        // replay the redo stack forwards and then backwards, both directions share the same steps
+        auto begin = log.size();
+        log.insert(log.end(), redo_stack.rbegin(), redo_stack.rend());
+        push_run(begin, log.size(), false);
+        push_run(begin, log.size(), true);
+        redo_stack.clear();
+      }
+      push_step({node, false});
+      current_ = node;
+      mergeable_ = true;
+      if (type != nullptr && type->rebuild != nullptr) {
+        node->bytes = command->bytes();
+        resident_bytes += node->bytes;
+        resident.push_back(node);
+        enforce_budget();
+      }
+    }
+
+    public:
+
+    // takes ownership of a heap allocated command
+    void push(Command * command) {
+      push(command, nullptr);
+    }
+
+    // constructs a command in the arena of this stack and pushes it
+    template <typename C, typename ... Args>
+    C * emplace(Args && ... args) {
+      C * command = tree.arena.template make<C>(std::forward<Args>(args)...);
+      push(command, command_type<C>());
+      return command;
+    }
+
+    // the bytes of commands kept in memory before the oldest are spilled, zero keeps every command in memory
+    //  commands read back for an undo, a redo or a backtrace count again until the next push
+    void set_history_budget(std::size_t bytes) {
+      history_budget = bytes;
+      enforce_budget();
+    }
+
+    std::size_t get_history_budget() const {
+      return history_budget;
+    }
+
+    // the bytes of spillable commands currently in memory
+    std::size_t history_resident_bytes() const {
+      return resident_bytes;
+    }
+
+    // where cold commands are kept, this applies to commands moved to cold storage from now on
+    void set_cold_storage(ColdStorage storage) {
+      cold.set_storage(storage);
+    }
+
+    ColdStorage get_cold_storage() const {
+      return cold.storage();
+    }
+
+    // the raw bytes of cold commands compressed together, see ColdStore::set_block_size
+    void set_cold_block_size(std::size_t bytes) {
+      cold.set_block_size(bytes);
+    }
+
+    std::size_t get_cold_block_size() const {
+      return cold.block_size();
+    }
+
+    // the encoded size of every command moved to cold storage
+    uint64_t cold_raw_bytes() const {
+      return cold.raw_bytes();
+    }
+
+    // the size cold storage holds for them after compression
+    uint64_t cold_stored_bytes() const {
+      return cold.stored_bytes();
+    }
+
+    // reset, and dropping the undone commands in basic mode, hand them to reclaimer instead of destroying them, nullptr destroys them in place
+    void set_reclaimer(Reclaimer * reclaimer) {
+      this->reclaimer = reclaimer;
+    }
+
+    // the number of leading undo stack entries that are unchanged since the last call to settle
+    //  lets a view of the undo stack be brought up to date by visiting only the entries past it
+    std::size_t settled() const {
+      return settled_;
+    }
+
+    void settle() {
+      settled_ = undo_size;
+    }
+
+    // the instance commands are read back for, so that commands need not spill pointers to it
+    void set_spill_context(const T * instance) {
+      spill_context = instance;
+    }
+
+    // the nodes of the tree, the root included
+    //  the nodes that can no longer be reached are dropped while the history is a single branch
+    std::size_t node_count() const {
+      return tree.nodes.size();
+    }
+
+    // bytes reserved for commands constructed by emplace
+    std::size_t arena_capacity() const {
+      return tree.arena.capacity();
     }
 
     std::size_t undo_to_index(std::size_t index, T * instance) {
-      std::size_t old = undo_stack.size();
-      while (undo_stack.size() != index) {
+      std::size_t old = undo_size;
+      while (undo_size != index) {
         undo(instance);
       }
       return old;
     }
 
     void redo_to_index(std::size_t index, T * instance) {
-      while (undo_stack.size() != index) {
+      while (undo_size != index) {
         redo(instance);
       }
     }
 
+    // moves the undo stack to index without applying any command
+    //  the caller is responsible for bringing the document to the state of index
+    void move_to_index(std::size_t index) {
+      mergeable_ = false;
+      while (undo_size > index) {
+        auto step = top();
+        if (supports_redo) {
+          redo_stack.push_back(step);
+        }
+        pop();
+        current_ = step.inverted ? step.node : step.node->parent_;
+      }
+      if (!supports_redo) {
+        drop_unreachable();
+      }
+      while (undo_size < index && redo_stack.size() != 0) {
+        auto step = redo_stack.back();
+        current_ = step.inverted ? step.node->parent_ : step.node;
+        push_step(step);
+        redo_stack.pop_back();
+      }
+    }
+
     void transform_undo_stack(const DarcsPatch::function<void(Command*)> & f) {
-      for (auto & cmd : undo_stack) {
-        f(static_cast<Command*>(cmd.get()));
+      for (auto & run : runs) {
+        if (run.inverted) {
+          for (auto i = run.end; i != run.begin; i--) {
+            f(command(log[i - 1].invert()));
+          }
+        } else {
+          for (auto i = run.begin; i != run.end; i++) {
+            f(command(log[i]));
+          }
+        }
       }
     }
 
     void transform_redo_stack(const DarcsPatch::function<void(Command*)> & f) {
-      for (auto & cmd : redo_stack) {
-        f(static_cast<Command*>(cmd.get()));
+      for (auto & step : redo_stack) {
+        f(command(step));
       }
     }
 
     const Command * get_index(std::size_t index) const {
-      if (undo_stack.size() == 0) {
+      if (index >= undo_size) {
         return nullptr;
       }
-      if (index > undo_stack.size()-1) {
+      return command(step_at(index));
+    }
+
+    // the command that takes the document from index to index + 1 along the current branch, past undoSize it is read from the redo stack
+    //  nullptr past the end of the branch
+    const Command * get_step(std::size_t index) const {
+      if (index < undo_size) {
+        return command(step_at(index));
+      }
+      auto above = index - undo_size;
+      if (above >= redo_stack.size()) {
         return nullptr;
       }
-      return static_cast<const Command*>(undo_stack[index].get());
+      return command(redo_stack[redo_stack.size() - 1 - above]);
     }
-    
+
     bool undo(T * instance) {
-      if (undo_stack.size() == 0) {
+      if (undo_size == 0) {
         return false;
       }
-      auto cmd = undo_stack.back();
+      mergeable_ = false;
+      auto step = top();
       if (supports_redo) {
-        redo_stack.push_back(cmd);
+        redo_stack.push_back(step);
+      }
+      pop();
+      undo_step(step, instance);
+      if (!supports_redo) {
+        // the undone step can never be taken again
+        drop_unreachable();
       }
-      // std::cout << "undo() : command: " << deref(cmd) << std::endl;
-      static_cast<Command*>(cmd.get())->undo(instance);
-      undo_stack.pop_back();
       return true;
     }
-    
+
     bool redo(T * instance) {
       if (!supports_redo || redo_stack.size() == 0) {
         return false;
       }
-      auto cmd = redo_stack.back();
-      // std::cout << "redo() : command: " << deref(cmd) << std::endl;
-      static_cast<Command*>(cmd.get())->redo(instance);
-      undo_stack.push_back(cmd);
+      mergeable_ = false;
+      auto step = redo_stack.back();
+      redo_step(step, instance);
+      push_step(step);
       redo_stack.pop_back();
       return true;
     }
 
+    /*
+       drops the undo stack entries below index, the state at index becomes the root
+
+       the entries from index on and then the redo stack are kept as a single branch, every other branch is dropped
+        copy(command, inverted) makes the command of a kept step as a C, taking the command back if inverted is true
+       the old history is handed to the reclaimer as reset does, the history budget applies to the kept commands as they are pushed
+    */
+    template <typename C>
+    void squash(std::size_t index, const DarcsPatch::function<C(const Command *, bool)> & copy) {
+      if (index > undo_size) {
+        throw std::runtime_error("the undo stack index cannot be reached");
+      }
+      std::vector<C> kept;
+      auto keep = [&](const Step & step) {
+        load(step.node);
+        kept.push_back(copy(step.node->command_.get(), step.inverted));
+      };
+      for (std::size_t i = index; i < undo_size; i++) {
+        keep(step_at(i));
+      }
+      auto size = undo_size - index;
+      for (auto it = redo_stack.rbegin(); it != redo_stack.rend(); it++) {
+        keep(*it);
+      }
+
+      if (reclaimer != nullptr) {
+        reclaimer->retire(std::move(tree));
+        reclaimer->retire(std::move(log));
+        reclaimer->retire(std::move(resident));
+        reclaimer->retire(std::move(cold));
+      }
+      clear();
+      for (auto & command : kept) {
+        emplace<C>(std::move(command));
+      }
+      move_to_index(size);
+    }
+
     virtual ~UndoStack() {
     }
-    
+
     void reset() {
       // puts("RESET REDO");
-      std::cout << *this << std::endl;
-      if (undo_stack.size() != 0) {
-        undo_stack = std::move(STACK());
+      if (reclaimer != nullptr) {
+        reclaimer->retire(std::move(tree));
+        reclaimer->retire(std::move(log));
+        reclaimer->retire(std::move(resident));
+        reclaimer->retire(std::move(cold));
       }
-      if (redo_stack.size() != 0) {
-        redo_stack = std::move(STACK());
+      clear();
+    }
+
+    private:
+
+    void clear() {
+      redo_stack = {};
+      run_offsets = {};
+      runs = {};
+      log = {};
+      undo_size = 0;
+      settled_ = 0;
+      mergeable_ = false;
+      branches_ = 0;
+      resident = {};
+      resident_bytes = 0;
+      auto storage = cold.storage();
+      auto block_size = cold.block_size();
+      cold = ColdStore();
+      cold.set_storage(storage);
+      cold.set_block_size(block_size);
+      tree.nodes.clear();
+      tree.arena.clear();
+      tree.nodes.emplace_back(nullptr, nullptr, nullptr);
+      current_ = &tree.nodes.front();
+    }
+
+    // a count read back, every element takes at least a byte so a count past the end of the input is corrupt
+    static std::size_t get_count(SpillReader & in) {
+      auto count = in.get_varint();
+      if (count > in.bytes.size() - in.position) {
+        throw std::runtime_error("saved history is truncated");
       }
+      return count;
+    }
 
+    static void put_step(SpillWriter & out, const Step & step) {
+      out.put_varint((step.node->index << 1) | (step.inverted ? 1 : 0));
     }
 
-    virtual std::ostream & to_stream(std::ostream & os) const {
-      os << "Undo Stack: " << std::to_string(undo_stack.size()) << " items in undo stack" << std::endl;
-      if (undo_stack.size() != 0) {
-        std::size_t idx = 0;
-        for (auto & shared_command : undo_stack) {
-          os << "    undo #" << std::to_string(idx) << " : ";
-          shared_command->to_stream(os, shared_command->is_inverted()) << std::endl;
-          idx++;
+    Step get_step(SpillReader & in) const {
+      auto value = in.get_varint();
+      if ((value >> 1) >= tree.nodes.size()) {
+        throw std::runtime_error("saved history refers to a node that does not exist");
+      }
+      return {&tree.nodes[value >> 1], (value & 1) != 0};
+    }
+
+    public:
+
+    /*
+       writes the tree, the undo stack and the redo stack out
+
+       every command must be spillable, the record of a command is the same one it spills to cold storage
+        throws std::runtime_error otherwise
+    */
+    void save(SpillWriter & out) const {
+      out.put_varint(supports_redo ? 1 : 0);
+      out.put_varint(supports_advanced_undo ? 1 : 0);
+      out.put_varint(tree.nodes.size());
+      for (std::size_t i = 1; i < tree.nodes.size(); i++) {
+        auto & node = tree.nodes[i];
+        out.put_varint(i - node.parent_->index);
+        if (node.type == nullptr || node.type->rebuild == nullptr) {
+          throw std::runtime_error("the history holds a command that cannot be saved");
+        }
+        if (node.command_) {
+          SpillWriter record;
+          if (!node.command_->spill(record)) {
+            throw std::runtime_error("the history holds a command that cannot be saved");
+          }
+          out.put_varint(record.bytes.size());
+          out.bytes.append(record.bytes);
+        } else {
+          out.put_varint(node.spill_length);
+          out.bytes.append(cold.read(node.spill_offset, node.spill_length));
         }
       }
+      out.put_varint(current_->index);
+      out.put_varint(log.size());
+      for (auto & step : log) {
+        put_step(out, step);
+      }
+      out.put_varint(runs.size());
+      for (auto & run : runs) {
+        out.put_varint(run.begin);
+        out.put_varint(run.end - run.begin);
+        out.put_varint(run.inverted ? 1 : 0);
+      }
+      out.put_varint(redo_stack.size());
+      for (auto & step : redo_stack) {
+        put_step(out, step);
+      }
+    }
+
+    /*
+       replaces this history with one written by save, every command is read back as C
+
+       the records are moved to cold storage as they are, a command is only rebuilt when it is next needed
+        the history budget applies from the next push
+    */
+    template <typename C>
+    void restore(SpillReader & in) {
+      clear();
+      supports_redo = in.get_varint() != 0;
+      supports_advanced_undo = in.get_varint() != 0;
+      auto type = command_type<C>();
+      if (type->rebuild == nullptr) {
+        throw std::runtime_error("the command type cannot be read back");
+      }
+      auto count = get_count(in);
+      for (std::size_t i = 1; i < count; i++) {
+        auto parent = in.get_varint();
+        if (parent == 0 || parent > i) {
+          throw std::runtime_error("saved history refers to a node that does not exist");
+        }
+        tree.nodes.emplace_back(nullptr, type, &tree.nodes[i - parent]);
+        Node * node = &tree.nodes.back();
+        node->index = i;
+        node->parent_->children.push_back(node);
+        if (node->parent_->children.size() == 2) {
+          branches_++;
+        }
+        std::size_t length = in.get_varint();
+        auto record = in.get_bytes(length);
+        node->spill_offset = cold.write(std::string(record, length));
+        node->spill_length = length;
+      }
+      auto current = in.get_varint();
+      if (current >= tree.nodes.size()) {
+        throw std::runtime_error("saved history refers to a node that does not exist");
+      }
+      current_ = &tree.nodes[current];
+      log.resize(get_count(in));
+      for (auto & step : log) {
+        step = get_step(in);
+      }
+      auto run_count = get_count(in);
+      for (std::size_t i = 0; i < run_count; i++) {
+        std::size_t begin = in.get_varint();
+        std::size_t end = begin + in.get_varint();
+        bool inverted = in.get_varint() != 0;
+        if (end > log.size()) {
+          throw std::runtime_error("saved history refers to a step that does not exist");
+        }
+        push_run(begin, end, inverted);
+      }
+      redo_stack.resize(get_count(in));
+      for (auto & step : redo_stack) {
+        step = get_step(in);
+      }
+    }
+
+    virtual std::ostream & to_stream(std::ostream & os) const {
+      os << "Undo Stack: " << std::to_string(undo_size) << " items in undo stack" << std::endl;
+      for (std::size_t idx = 0; idx < undo_size; idx++) {
+        auto cmd = command(step_at(idx));
+        os << "    undo #" << std::to_string(idx) << " : ";
+        cmd->to_stream(os, cmd->is_inverted()) << std::endl;
+      }
       os << "Undo Stack: " << std::to_string(redo_stack.size()) << " items in redo stack" << std::endl;
       if (redo_stack.size() != 0) {
         std::size_t idx = 0;
-        for (auto & shared_command : redo_stack) {
+        for (auto & step : redo_stack) {
+          auto cmd = command(step);
           os << "    redo #" << std::to_string(idx) << " : ";
-          shared_command->to_stream(os, shared_command->is_inverted()) << std::endl;
+          cmd->to_stream(os, cmd->is_inverted()) << std::endl;
           idx++;
         }
       }
@@ -247,4 +1061,4 @@ namespace MiniDoc {
       return stack.to_stream(os);
   }
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,523 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#define MINIDOC_GENERIC_PIECE_TABLE_FUNCTION_TYPE DarcsPatch::function
+#define STRING_ADAPTER_FUNCTION_TYPE DarcsPatch::function
+
+#include <minidoc.h>
+
+template <typename F>
+double ns_per_op(std::size_t iterations, F && f) {
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; i++) {
+        f(i);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+// keeps the optimizer from discarding benchmark results
+volatile std::size_t sink;
+
+struct CacheTarget {
+    std::size_t offset = 3;
+
+    std::size_t value(std::size_t x) const {
+        return x + offset;
+    }
+
+    MINIDOC_CACHE_FUNC(cache_value, CacheTarget::value);
+    MINIDOC_STATIC_CACHE_FUNC(static_cache_value, CacheTarget::value);
+
+    MiniDoc::CacheInvalidator caches = [](void * this_) -> std::vector<MiniDoc::CacheBase *> {
+        return { &static_cast<CacheTarget*>(this_)->cache_value };
+    };
+
+    auto static_caches() {
+        return std::tie(static_cache_value);
+    }
+};
+
+void bench_cache() {
+    const std::size_t iterations = 10000000;
+    CacheTarget t;
+
+    puts("cache (type erased vs static)");
+
+    printf("    hit:               %8.2f ns/op  vs  %8.2f ns/op\n",
+        ns_per_op(iterations, [&](std::size_t i) { sink = t.cache_value(&t, 1); }),
+        ns_per_op(iterations, [&](std::size_t i) { sink = t.static_cache_value(&t, 1); })
+    );
+
+    printf("    argument miss:     %8.2f ns/op  vs  %8.2f ns/op\n",
+        ns_per_op(iterations, [&](std::size_t i) { sink = t.cache_value(&t, i); }),
+        ns_per_op(iterations, [&](std::size_t i) { sink = t.static_cache_value(&t, i); })
+    );
+
+    printf("    invalidate + miss: %8.2f ns/op  vs  %8.2f ns/op\n",
+        ns_per_op(iterations, [&](std::size_t i) { t.caches.invalidate(&t); sink = t.cache_value(&t, 1); }),
+        ns_per_op(iterations, [&](std::size_t i) { MiniDoc::StaticCacheInvalidator::invalidate(t.static_caches()); sink = t.static_cache_value(&t, 1); })
+    );
+}
+
+struct CounterCommand : MiniDoc::UndoStack<std::size_t>::Command {
+    std::size_t delta = 1;
+
+    void undo(std::size_t * instance) override {
+        *instance -= delta;
+    }
+
+    void redo(std::size_t * instance) override {
+        *instance += delta;
+    }
+};
+
+void bench_undo_stack() {
+    const std::size_t iterations = 1000000;
+
+    puts("undo stack (heap vs arena)");
+
+    MiniDoc::UndoStack<std::size_t> heap, arena;
+    printf("    push:              %8.2f ns/op  vs  %8.2f ns/op\n",
+        ns_per_op(iterations, [&](std::size_t i) { heap.push(new CounterCommand()); }),
+        ns_per_op(iterations, [&](std::size_t i) { arena.emplace<CounterCommand>(); })
+    );
+
+    std::size_t a = 0, b = 0;
+    printf("    undo all:          %8.2f ns/op  vs  %8.2f ns/op\n",
+        ns_per_op(iterations, [&](std::size_t i) { heap.undo(&a); }),
+        ns_per_op(iterations, [&](std::size_t i) { arena.undo(&b); })
+    );
+    sink = a + b;
+}
+
+void bench_cold_history() {
+    const std::size_t edits = 2000;
+
+    puts("cold history (in memory vs compressed in memory vs compressed in a file)");
+
+    MiniDoc::MiniDoc_T docs[3];
+    docs[1].set_history_budget(1);
+    docs[1].set_cold_storage(MiniDoc::ColdStorage::MEMORY);
+    docs[2].set_history_budget(1);
+    for (auto & m : docs) {
+        m.load("");
+        for (std::size_t i = 0; i < edits; i++) {
+            m.insert(i % 64, "x");
+            if (i % 3 == 0) {
+                m.erase(i % 5, 2);
+            }
+        }
+    }
+    auto steps = docs[0].undoStack().undoSize();
+
+    printf("    raw / stored:      %8llu B  vs  %8llu B\n",
+        (unsigned long long) docs[1].undoStack().cold_raw_bytes(),
+        (unsigned long long) docs[1].undoStack().cold_stored_bytes()
+    );
+
+    printf("    undo all:          %8.2f ns/op  vs  %8.2f ns/op  vs  %8.2f ns/op\n",
+        ns_per_op(steps, [&](std::size_t i) { docs[0].undo(); }),
+        ns_per_op(steps, [&](std::size_t i) { docs[1].undo(); }),
+        ns_per_op(steps, [&](std::size_t i) { docs[2].undo(); })
+    );
+
+    printf("    redo all:          %8.2f ns/op  vs  %8.2f ns/op  vs  %8.2f ns/op\n",
+        ns_per_op(steps, [&](std::size_t i) { docs[0].redo(); }),
+        ns_per_op(steps, [&](std::size_t i) { docs[1].redo(); }),
+        ns_per_op(steps, [&](std::size_t i) { docs[2].redo(); })
+    );
+
+    // every state read back from cold storage matches the one kept in memory
+    std::size_t mismatches = 0;
+    while (docs[0].undo()) {
+        for (int d = 1; d < 3; d++) {
+            docs[d].undo();
+            mismatches += std::strcmp(docs[d].str().c_str().ptr(), docs[0].str().c_str().ptr()) != 0;
+        }
+    }
+    printf("    states mismatched: %8zu of %zu\n", mismatches, steps);
+
+    // a store where three quarters of the records are released, then rewritten into the freed file space
+    const std::size_t records = 20000;
+    MiniDoc::ColdStore store;
+    std::vector<std::pair<uint64_t, std::string>> written;
+    for (std::size_t i = 0; i < records; i++) {
+        auto record = std::to_string(i) + std::string(i % 7, 'r');
+        written.push_back({ store.write(record), record });
+    }
+    auto stored = store.stored_bytes();
+    auto file = store.file_bytes();
+    auto release = ns_per_op(records * 3 / 4, [&](std::size_t i) { store.release(written[i].first, written[i].second.size()); });
+    auto released = store.stored_bytes();
+    auto rewrite = ns_per_op(records / 2, [&](std::size_t i) { store.write(written[i].second); });
+    printf("    release / rewrite: %8.2f ns/op  vs  %8.2f ns/op  (stored %llu B to %llu B, file %llu B to %llu B)\n",
+        release, rewrite,
+        (unsigned long long) stored, (unsigned long long) released,
+        (unsigned long long) file, (unsigned long long) store.file_bytes()
+    );
+}
+
+void bench_save_restore() {
+    const std::size_t edits = 2000;
+    const std::size_t iterations = 100;
+
+    puts("save and restore (per history entry)");
+
+    MiniDoc::MiniDoc_T a, b;
+    a.load("");
+    for (std::size_t i = 0; i < edits; i++) {
+        a.insert(i % 64, "x");
+    }
+    std::stringstream saved;
+    a.save(saved);
+    auto bytes = saved.str();
+
+    printf("    save:              %8.2f ns/entry\n",
+        ns_per_op(iterations, [&](std::size_t i) { std::stringstream out; a.save(out); sink = out.tellp(); }) / edits
+    );
+    printf("    restore:           %8.2f ns/entry\n",
+        ns_per_op(iterations, [&](std::size_t i) { std::stringstream in(bytes); b.restore(in); sink = b.length(); }) / edits
+    );
+    printf("    size:              %8.2f B/entry\n", (double) bytes.size() / edits);
+}
+
+void bench_undo_batch() {
+    const std::size_t edits = 2000;
+
+    puts("undo everything (one step at a time vs undo(n))");
+
+    MiniDoc::MiniDoc_T docs[2];
+    for (auto & m : docs) {
+        m.load("");
+        for (std::size_t i = 0; i < edits; i++) {
+            m.insert(i % 64, i % 16 == 0 ? "\n" : "x");
+        }
+    }
+
+    printf("    undo:              %8.2f ms     vs  %8.2f ms\n",
+        ns_per_op(1, [&](std::size_t i) { while (docs[0].undo()) {} }) / 1e6,
+        ns_per_op(1, [&](std::size_t i) { docs[1].undo(edits); }) / 1e6
+    );
+    printf("    redo:              %8.2f ms     vs  %8.2f ms\n",
+        ns_per_op(1, [&](std::size_t i) { while (docs[0].redo()) {} }) / 1e6,
+        ns_per_op(1, [&](std::size_t i) { docs[1].redo(edits); }) / 1e6
+    );
+}
+
+void bench_reclaim() {
+    const std::size_t edits = 2000;
+    const std::size_t iterations = 20;
+
+    puts("load over a large history (freed in place vs reclaimed)");
+
+    MiniDoc::Reclaimer reclaimer;
+    MiniDoc::MiniDoc_T docs[2];
+    docs[1].set_reclaimer(&reclaimer);
+    double ns[2] = {};
+    for (std::size_t i = 0; i < iterations; i++) {
+        for (std::size_t d = 0; d < 2; d++) {
+            auto & m = docs[d];
+            m.load("");
+            for (std::size_t k = 0; k < edits; k++) {
+                m.insert(k % 64, "x");
+            }
+            ns[d] += ns_per_op(1, [&](std::size_t i) { m.load(""); });
+        }
+    }
+    reclaimer.drain();
+
+    printf("    load:              %8.2f us     vs  %8.2f us\n", ns[0] / iterations / 1e3, ns[1] / iterations / 1e3);
+}
+
+void bench_transaction() {
+    const std::size_t edits = 200;
+    const std::size_t iterations = 5;
+
+    puts("a batch of edits (recorded one by one vs in a transaction)");
+
+    MiniDoc::MiniDoc_T docs[4];
+    for (auto & m : docs) {
+        m.load("");
+        for (std::size_t i = 0; i < edits; i++) {
+            m.insert(i % 64, i % 16 == 0 ? "\n" : "x");
+        }
+    }
+
+    auto batch = [&](MiniDoc::MiniDoc_T & m) {
+        for (std::size_t i = 0; i < edits; i++) {
+            m.insert((i * 7) % 64, i % 8 == 0 ? "\n" : "y");
+        }
+    };
+
+    printf("    keep:              %8.2f ms     vs  %8.2f ms\n",
+        ns_per_op(1, [&](std::size_t i) { batch(docs[0]); }) / 1e6,
+        ns_per_op(1, [&](std::size_t i) { docs[1].begin_transaction(); batch(docs[1]); docs[1].commit(); }) / 1e6
+    );
+    printf("    abandon:           %8.2f ms     vs  %8.2f ms\n",
+        ns_per_op(iterations, [&](std::size_t i) { batch(docs[2]); for (std::size_t k = 0; k < edits; k++) docs[2].undo(); }) / 1e6,
+        ns_per_op(iterations, [&](std::size_t i) { docs[3].begin_transaction(); batch(docs[3]); docs[3].rollback(); }) / 1e6
+    );
+}
+
+void bench_diagnostics() {
+    const std::size_t edits = 2000;
+    const std::size_t iterations = 20;
+
+    puts("error() on a long history (first diagnostic vs later ones)");
+
+    MiniDoc::MiniDoc_T m;
+    m.load("");
+    for (std::size_t i = 0; i < edits; i++) {
+        m.insert(i % 64, i % 16 == 0 ? "\n" : "x");
+    }
+
+    // the backtraces are not part of the measurement
+    std::ostringstream sink;
+    auto out = std::cout.rdbuf(sink.rdbuf());
+    auto first = ns_per_op(1, [&](std::size_t i) { m.error("first"); });
+    auto later = ns_per_op(iterations, [&](std::size_t i) { m.error("later"); sink.str(""); });
+    std::cout.rdbuf(out);
+
+    printf("    error:             %8.2f ms     vs  %8.2f ms\n", first / 1e6, later / 1e6);
+}
+
+void bench_blame() {
+    const std::size_t lines = 100000;
+    const std::size_t edits = 200;
+    const std::size_t iterations = 20;
+
+    puts("blame every line of a 100k line file (first annotation vs after an edit)");
+
+    std::string text;
+    for (std::size_t i = 0; i < lines; i++) {
+        text += std::to_string(i);
+        text += "\n";
+    }
+    MiniDoc::MiniDoc_T m;
+    m.load(text.c_str());
+    for (std::size_t i = 0; i < edits; i++) {
+        m.insert((i * 7919) % m.length(), i % 4 == 0 ? "\n" : "x");
+    }
+
+    auto first = ns_per_op(1, [&](std::size_t i) { m.blame(0, m.lines()); });
+    auto later = ns_per_op(iterations, [&](std::size_t i) { m.append("x"); m.blame(0, m.lines()); });
+
+    printf("    blame:             %8.2f ms     vs  %8.2f ms\n", first / 1e6, later / 1e6);
+}
+
+void bench_history_view() {
+    const std::size_t edits = 2000;
+    const std::size_t iterations = 200;
+
+    puts("read the document 1000 edits back (undo_to and back vs view_at)");
+
+    MiniDoc::MiniDoc_T m;
+    m.load("");
+    for (std::size_t i = 0; i < edits; i++) {
+        m.insert(i % 64, i % 16 == 0 ? "\n" : "x");
+    }
+
+    auto index = edits / 2;
+    auto seek = ns_per_op(iterations, [&](std::size_t i) { m.undo_to(index); m.str(); m.undo_to(edits); });
+    auto view = ns_per_op(iterations, [&](std::size_t i) { m.view_at(index).str(); });
+
+    printf("    history view:      %8.2f us     vs  %8.2f us\n", seek / 1e3, view / 1e3);
+}
+
+void bench_error_batch() {
+    const std::size_t edits = 2000;
+    const std::size_t diagnostics = 100;
+
+    puts("report 100 diagnostics on a long history (error per diagnostic vs error_batch)");
+
+    MiniDoc::MiniDoc_T m;
+    m.load("");
+    for (std::size_t i = 0; i < edits; i++) {
+        m.insert(i % 64, i % 16 == 0 ? "\n" : "x");
+    }
+    std::vector<MiniDoc::MiniDoc_T::Diagnostic> batch;
+    for (std::size_t i = 0; i < diagnostics; i++) {
+        batch.push_back({ (i * 7) % m.lines(), 0, "lint" });
+    }
+
+    // the backtraces are not part of the measurement, nor is building the patches
+    std::ostringstream sink;
+    auto out = std::cout.rdbuf(sink.rdbuf());
+    m.error();
+    auto single = ns_per_op(1, [&](std::size_t i) {
+        for (auto & d : batch) {
+            m.seek_line(d.line);
+            m.error(d.message);
+            sink.str("");
+        }
+    });
+    auto batched = ns_per_op(1, [&](std::size_t i) { m.error_batch(batch); sink.str(""); });
+    std::cout.rdbuf(out);
+
+    printf("    error_batch:       %8.2f ms     vs  %8.2f ms\n", single / 1e6, batched / 1e6);
+}
+
+void bench_commute_memo() {
+    const std::size_t edits = 2000;
+    const std::size_t iterations = 20;
+
+    puts("blame after undoing and redoing 500 of 2000 edits (first build vs rebuild)");
+
+    MiniDoc::MiniDoc_T m;
+    m.load("");
+    for (std::size_t i = 0; i < edits; i++) {
+        m.insert(i % 64, i % 16 == 0 ? "\n" : "x");
+    }
+
+    auto first = ns_per_op(1, [&](std::size_t i) { m.blame(0); });
+    std::size_t hits = m.patch_graph().memo_hits();
+    auto later = ns_per_op(iterations, [&](std::size_t i) { m.undo(500); m.blame(0); m.redo(500); m.blame(0); });
+    hits = m.patch_graph().memo_hits() - hits;
+
+    printf("    commute memo:      %8.2f ms     vs  %8.2f ms     (%zu of %zu patches reused)\n", first / 1e6, later / 1e6, hits, iterations * 500);
+}
+
+void bench_parallel_graph() {
+    const std::size_t patches = 10000;
+    const std::size_t threads = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+
+    printf("dependencies of 10000 hunks (one thread vs %zu)\n", threads);
+
+    std::vector<MiniDoc::HunkShape> shapes;
+    for (std::size_t i = 0; i < patches; i++) {
+        shapes.push_back({ (i * 7919) % 5000, i % 3, (i * 5) % 4 });
+    }
+
+    auto single = ns_per_op(1, [&](std::size_t i) { MiniDoc::PatchGraph g; g.push(shapes, 1); });
+    auto parallel = ns_per_op(1, [&](std::size_t i) { MiniDoc::PatchGraph g; g.push(shapes, threads); });
+
+    printf("    graph:             %8.2f ms     vs  %8.2f ms\n", single / 1e6, parallel / 1e6);
+}
+
+void bench_commute_pruning() {
+    const std::size_t patches = 10000;
+
+    puts("dependencies of 10000 hunks spread over 100k lines");
+
+    std::vector<MiniDoc::HunkShape> shapes;
+    for (std::size_t i = 0; i < patches; i++) {
+        shapes.push_back({ (i * 7919) % 100000, i % 2, (i * 5) % 3 });
+    }
+
+    MiniDoc::PatchGraph g;
+    auto time = ns_per_op(1, [&](std::size_t i) { g.push(shapes, 1); });
+
+    printf("    graph:             %8.2f ms     %8.2f commutes per patch\n", time / 1e6, (double)g.commutes() / patches);
+}
+
+void bench_graph_push() {
+    const std::size_t pushes = 1000;
+
+    puts("push a hunk after 1k, 10k and 100k hunks spread over 1M lines");
+
+    auto shape = [](std::size_t i) -> MiniDoc::HunkShape {
+        return { (i * 7919) % 1000000, i % 2, (i * 5) % 3 };
+    };
+
+    double times[3];
+    std::size_t history = 1000;
+    for (auto & time : times) {
+        MiniDoc::PatchGraph g;
+        for (std::size_t i = 0; i < history; i++) {
+            g.push(shape(i));
+        }
+        time = ns_per_op(pushes, [&](std::size_t i) { g.push(shape(history + i)); });
+        history *= 10;
+    }
+
+    printf("    push:              %8.2f us     vs  %8.2f us     vs  %8.2f us\n", times[0] / 1e3, times[1] / 1e3, times[2] / 1e3);
+}
+
+void bench_export_graph() {
+    const std::size_t edits = 2000;
+    const std::size_t iterations = 20;
+
+    puts("export the graph of 2000 edits (DOT vs JSON)");
+
+    MiniDoc::MiniDoc_T m;
+    m.load("");
+    for (std::size_t i = 0; i < edits; i++) {
+        m.insert(i % 64, i % 16 == 0 ? "\n" : "x");
+    }
+    m.blame(0);
+
+    std::size_t bytes = 0;
+    auto sink = [&](const char * data, std::size_t length) { bytes += length; };
+    auto dot = ns_per_op(iterations, [&](std::size_t i) { m.export_graph(MiniDoc::MiniDoc_T::GraphFormat::DOT, sink); });
+    auto json = ns_per_op(iterations, [&](std::size_t i) { m.export_graph(MiniDoc::MiniDoc_T::GraphFormat::JSON, sink); });
+
+    printf("    export:            %8.2f ms     vs  %8.2f ms     (%zu bytes)\n", dot / 1e6, json / 1e6, bytes / iterations / 2);
+}
+
+void bench_undo_edit() {
+    const std::size_t edits = 2000;
+    const std::size_t iterations = 20;
+
+    puts("take back one of the first 1000 of 2000 edits, each on a line of its own");
+
+    MiniDoc::MiniDoc_T m;
+    m.load(std::string(edits * 2, '\n').c_str());
+    for (std::size_t i = 0; i < edits; i++) {
+        // every other line, each line before it has one character
+        m.insert(i * 3, "x");
+    }
+    m.blame(0);
+
+    std::size_t taken = 0;
+    auto time = ns_per_op(iterations, [&](std::size_t i) { taken += m.undo_edit(1 + i * 50); });
+
+    printf("    undo edit:         %8.2f ms     (%zu of %zu taken back)\n", time / 1e6, taken, iterations);
+}
+
+void bench_squash_history() {
+    const std::size_t edits = 4000;
+    const std::size_t kept = 200;
+
+    puts("blame over 4000 edits (whole history vs the last 200 after squashing)");
+
+    MiniDoc::MiniDoc_T m, n;
+    for (auto d : { &m, &n }) {
+        d->load("");
+        for (std::size_t i = 0; i < edits; i++) {
+            d->insert(i % 64, i % 16 == 0 ? "\n" : "x");
+        }
+    }
+
+    auto whole = ns_per_op(1, [&](std::size_t i) { m.blame(0); });
+    // squashed in a session whose patches are up to date
+    n.blame(0);
+    auto squash = ns_per_op(1, [&](std::size_t i) { n.squash_history(edits - kept); });
+    auto squashed = ns_per_op(1, [&](std::size_t i) { n.blame(0); });
+
+    printf("    blame:             %8.2f ms     vs  %8.2f ms     (squash %.2f ms, %zu vs %zu patches)\n", whole / 1e6, squashed / 1e6, squash / 1e6, m.patch_graph().size(), n.patch_graph().size());
+}
+
+int main() {
+    bench_cache();
+    bench_undo_stack();
+    bench_cold_history();
+    bench_save_restore();
+    bench_undo_batch();
+    bench_reclaim();
+    bench_transaction();
+    bench_diagnostics();
+    bench_blame();
+    bench_history_view();
+    bench_error_batch();
+    bench_commute_memo();
+    bench_parallel_graph();
+    bench_commute_pruning();
+    bench_graph_push();
+    bench_export_graph();
+    bench_undo_edit();
+    bench_squash_history();
+    return 0;
+}
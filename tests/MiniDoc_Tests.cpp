@@ -1,4 +1,5 @@
 #include <gtest/gtest.h>
+#include <random>
 
 #define MINIDOC_GENERIC_PIECE_TABLE_FUNCTION_TYPE DarcsPatch::function
 #define STRING_ADAPTER_FUNCTION_TYPE DarcsPatch::function
@@ -281,6 +282,18 @@ TEST(MiniDoc, insert) {
     ASSERT_STREQ(m.str().c_str().ptr(), "all\nthe\nclean\nblue\nseats\nwhere\nduly\noccupied");
 }
 
+TEST(MiniDoc, line_pieces) {
+    MiniDoc::MiniDoc_T m;
+    m.load("0123456789\nabcdefghij\n");
+    // line 1 starts inside the first piece and runs on over shorter ones
+    m.insert(15, "X");
+    m.insert(18, "YZ");
+    ASSERT_STREQ(m.str().c_str().ptr(), "0123456789\nabcdXefYZghij\n");
+    m.seek_line(1);
+    ASSERT_STREQ(m.line_str().c_str().ptr(), "abcdXefYZghij\n");
+    ASSERT_STREQ(m.sub_str(13, 8).c_str().ptr(), "cdXefYZg");
+}
+
 TEST(MiniDoc, replace) {
     MiniDoc::MiniDoc_T m;
     m.load("");
@@ -470,6 +483,1101 @@ TEST(MiniDoc, undo_redo_4) {
     ASSERT_STREQ(m.str().c_str().ptr(), "");
 }
 
+TEST(MiniDoc, undo_tree) {
+    MiniDoc::MiniDoc_T m;
+    m.load("");
+    m.append("A");
+    m.append("B");
+    m.append("C");
+    m.undo();
+    m.undo();
+    m.undo();
+    m.append("X");
+    auto & stack = m.undoStack();
+    ASSERT_EQ(stack.undoSize(), 7);
+    auto root = stack.root();
+    ASSERT_EQ(root->child_count(), 2);
+    ASSERT_EQ(root->child(0)->child(0)->child(0)->child_count(), 0);
+    ASSERT_EQ(stack.current(), root->child(1));
+    ASSERT_EQ(stack.current()->depth(), 1);
+    m.undo();
+    ASSERT_EQ(stack.current(), root);
+    for (int i = 0; i < 6; i++) {
+        m.undo();
+    }
+    ASSERT_STREQ(m.str().c_str().ptr(), "");
+    ASSERT_EQ(stack.current(), root);
+    m.redo();
+    m.redo();
+    m.redo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "ABC");
+    ASSERT_EQ(stack.current(), root->child(0)->child(0)->child(0));
+    // edits are constructed in the arena of the stack
+    ASSERT_NE(stack.arena_capacity(), 0);
+}
+
+TEST(MiniDoc, coalesce) {
+    MiniDoc::MiniDoc_T m;
+    m.load("");
+    MiniDoc::MiniDoc_T::CoalescePolicy policy;
+    policy.inserts = true;
+    policy.backspaces = true;
+    policy.deletes = true;
+    m.set_coalesce_policy(policy);
+    m.append("a");
+    m.append("b");
+    m.append("\n");
+    m.append("c");
+    ASSERT_EQ(m.undoStack().undoSize(), 1);
+    m.erase(3, 1);
+    m.erase(2, 1);
+    ASSERT_STREQ(m.str().c_str().ptr(), "ab");
+    ASSERT_EQ(m.undoStack().undoSize(), 2);
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "ab\nc");
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "");
+    m.redo();
+    m.redo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "ab");
+    // a redo ends the record, so this starts a new one
+    m.erase(0, 1);
+    m.erase(0, 1);
+    ASSERT_EQ(m.undoStack().undoSize(), 3);
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "ab");
+    m.insert(1, "x");
+    m.replace(0, 1, "y");
+    ASSERT_STREQ(m.str().c_str().ptr(), "yxb");
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "axb");
+}
+
+TEST(MiniDoc, undo_spans) {
+    MiniDoc::MiniDoc_T m;
+    m.load("hello\nworld");
+    m.insert(5, ",");
+    m.erase(0, 12);
+    ASSERT_STREQ(m.str().c_str().ptr(), "");
+    // the erased text is referenced in the origin and append buffers, not copied
+    auto u = static_cast<const MiniDoc::MiniDoc_T::Info::UndoInfo*>(m.undoStack().get_index(1));
+    ASSERT_EQ(u->content.size(), 3);
+    ASSERT_EQ(u->content_length, 12);
+    ASSERT_EQ(u->old_lines, 1);
+    ASSERT_EQ(u->new_lines, 0);
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "hello,\nworld");
+    m.redo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "");
+    m.undo();
+    m.replace(0, 5, "HELLO");
+    ASSERT_STREQ(m.str().c_str().ptr(), "HELLO,\nworld");
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "hello,\nworld");
+
+    // pieces from both buffers are reinstated in the middle of the text, the append buffer does not grow
+    m.insert(9, "ab");
+    m.insert(3, "cd");
+    auto extent = m.get_info().append_extent();
+    m.erase(2, 10);
+    ASSERT_STREQ(m.str().c_str().ptr(), "hebrld");
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "helcdlo,\nwoabrld");
+    m.redo();
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "helcdlo,\nwoabrld");
+    ASSERT_EQ(m.get_info().append_extent(), extent);
+}
+
+static std::string checkpoint_backtrace(std::size_t interval) {
+    MiniDoc::MiniDoc_T m;
+    m.set_checkpoint_interval(interval);
+    m.load("all\nwhere\noccupied");
+    m.seek_line_start(1);
+    m.insert(m.cursor(), "the\nseats\n");
+    m.seek_line_start(2);
+    m.insert(m.cursor(), "clean\n");
+    m.seek_line_start(3);
+    m.insert(m.cursor(), "blue\n");
+    m.seek_line_start(4);
+    m.replace(m.cursor(), m.line_length()-1, "tables");
+    m.undo();
+    m.undo();
+    m.append("apples");
+    m.erase(0, 4);
+    m.seek_line(2);
+    testing::internal::CaptureStdout();
+    m.error("checkpoint");
+    auto out = testing::internal::GetCapturedStdout();
+    return out + m.str().c_str().ptr();
+}
+
+TEST(MiniDoc, history_checkpoints) {
+    auto expected = checkpoint_backtrace(0);
+    ASSERT_EQ(checkpoint_backtrace(1), expected);
+    ASSERT_EQ(checkpoint_backtrace(3), expected);
+}
+
+// the backtraces of every line
+static std::string backtraces(MiniDoc::MiniDoc_T & m) {
+    auto cursor = m.cursor();
+    testing::internal::CaptureStdout();
+    for (std::size_t line = 0; line < m.lines(); line++) {
+        m.seek_line(line);
+        m.error("backtrace");
+    }
+    m.seek(cursor);
+    return testing::internal::GetCapturedStdout();
+}
+
+TEST(MiniDoc, patch_list_incremental) {
+    MiniDoc::MiniDoc_T m;
+    MiniDoc::MiniDoc_T::CoalescePolicy policy;
+    policy.inserts = true;
+    m.set_coalesce_policy(policy);
+    m.load("0\n1\n2\n3\n4\n5\n6\n7\n");
+    // an edit after an undo replaces the undone entry
+    m.set_supports_advanced_undo(false);
+    for (int i = 0; i < 12; i++) {
+        if (i % 2 == 1) {
+            // drops an entry the last backtraces built a patch for, its replacement is on another line
+            m.undo();
+        }
+        m.seek_line_start(i * 5 % 8);
+        m.insert(m.cursor(), "x");
+        m.seek_line_start(i * 3 % 8);
+        m.insert(m.cursor(), "y\n");
+        if (i % 4 == 0) {
+            // coalesced, the top entry gains a line
+            m.append("z\n");
+            m.append("z\n");
+        }
+        // a restored copy has the same history and builds its patch list from scratch
+        std::stringstream saved;
+        m.save(saved);
+        MiniDoc::MiniDoc_T copy;
+        copy.restore(saved);
+        ASSERT_EQ(backtraces(m), backtraces(copy));
+    }
+}
+
+TEST(MiniDoc, patch_graph) {
+    MiniDoc::PatchGraph g;
+    // inserts a line at 5, then a line at 0
+    g.push({ 5, 0, 1 });
+    g.push({ 0, 0, 1 });
+    // the second insert commutes past the first, both only need the file
+    ASSERT_EQ(g.dependencies(1), std::vector<std::size_t>({ 0 }));
+    ASSERT_EQ(g.dependencies(2), std::vector<std::size_t>({ 0 }));
+    // changes the line added by the first insert, now at 6
+    g.push({ 6, 1, 1 });
+    ASSERT_EQ(g.dependencies(3), std::vector<std::size_t>({ 1 }));
+    // changes both added lines, the file is an indirect dependency
+    g.push({ 0, 7, 2 });
+    ASSERT_EQ(g.dependencies(4), std::vector<std::size_t>({ 2, 3 }));
+    g.truncate(3);
+    ASSERT_EQ(g.size(), 3);
+    g.push({ 9, 0, 1 });
+    ASSERT_EQ(g.dependencies(3), std::vector<std::size_t>({ 0 }));
+}
+
+TEST(MiniDoc, commute_memo) {
+    std::vector<MiniDoc::HunkShape> shapes;
+    for (std::size_t i = 0; i < 40; i++) {
+        shapes.push_back({ (i * 7) % 13, i % 3, (i + 1) % 4 });
+    }
+    auto same = [&](const MiniDoc::PatchGraph & a) {
+        MiniDoc::PatchGraph b;
+        for (std::size_t patch = 1; patch < a.size(); patch++) {
+            b.push(a.shape(patch));
+            ASSERT_EQ(a.dependencies(patch), b.dependencies(patch));
+        }
+    };
+    MiniDoc::PatchGraph g;
+    for (auto & shape : shapes) {
+        g.push(shape);
+    }
+    // the same hunks pushed again reuse their results, up to the first that differs
+    g.truncate(21);
+    g.truncate(11);
+    for (std::size_t i = 10; i < 30; i++) {
+        g.push(shapes[i]);
+    }
+    ASSERT_EQ(g.memo_hits(), 20);
+    same(g);
+    g.truncate(16);
+    g.push({ 1, 1, 1 });
+    g.push(shapes[16]);
+    ASSERT_EQ(g.memo_hits(), 20);
+    ASSERT_EQ(g.pushed(), 62);
+    same(g);
+
+    // redoing what was undone does not commute the hunks again
+    MiniDoc::MiniDoc_T m;
+    m.load("0\n1\n2\n3\n4\n5\n");
+    for (int i = 0; i < 10; i++) {
+        m.insert((i * 5) % m.length(), i % 2 == 0 ? "x\n" : "y");
+    }
+    auto expected = backtraces(m);
+    m.undo(4);
+    m.blame(0);
+    m.redo(4);
+    ASSERT_EQ(backtraces(m), expected);
+    ASSERT_EQ(m.patch_graph().memo_hits(), 4);
+}
+
+// the dependencies of every patch as darcs finds them, every earlier patch is commuted past the block
+static std::vector<std::vector<std::size_t>> reference_dependencies(const std::vector<MiniDoc::HunkShape> & shapes, std::size_t & commutes) {
+    std::vector<std::vector<std::size_t>> direct(shapes.size() + 1);
+    for (std::size_t patch = 1; patch <= shapes.size(); patch++) {
+        std::vector<bool> marked(patch, false);
+        std::vector<MiniDoc::HunkShape> block { shapes[patch - 1] };
+        for (std::size_t q = patch - 1; q != 0; q--) {
+            if (!marked[q]) {
+                auto moving = shapes[q - 1];
+                auto moved = block;
+                bool commutes_all = true;
+                for (auto it = moved.rbegin(); it != moved.rend() && commutes_all; it++) {
+                    commutes++;
+                    commutes_all = MiniDoc::commute_hunks(moving, *it);
+                }
+                if (commutes_all) {
+                    block = moved;
+                    continue;
+                }
+                direct[patch].push_back(q);
+                std::vector<std::size_t> walk { q };
+                while (walk.size() != 0) {
+                    auto next = walk.back();
+                    walk.pop_back();
+                    for (auto d : direct[next]) {
+                        if (!marked[d]) {
+                            marked[d] = true;
+                            walk.push_back(d);
+                        }
+                    }
+                }
+            }
+            block.push_back(shapes[q - 1]);
+        }
+        if (!marked[0]) {
+            direct[patch].push_back(0);
+        }
+        std::reverse(direct[patch].begin(), direct[patch].end());
+    }
+    return direct;
+}
+
+TEST(MiniDoc, commute_pruning) {
+    std::vector<MiniDoc::HunkShape> shapes;
+    for (std::size_t i = 0; i < 600; i++) {
+        // empty, touching and overlapping hunks of several lines
+        shapes.push_back({ (i * 7919) % 97, (i * 3) % 4, (i * 5) % 3 });
+    }
+    std::size_t commutes = 0;
+    auto expected = reference_dependencies(shapes, commutes);
+    MiniDoc::PatchGraph g;
+    for (auto & shape : shapes) {
+        g.push(shape);
+    }
+    for (std::size_t patch = 1; patch < g.size(); patch++) {
+        ASSERT_EQ(g.dependencies(patch), expected[patch]);
+    }
+    // only the patches near the lines of the block are commuted
+    ASSERT_LT(g.commutes() * 2, commutes);
+
+    // the runs past a truncate are indexed again for the hunks that follow
+    g.truncate(301);
+    for (std::size_t i = 300; i < shapes.size(); i++) {
+        shapes[i] = { (i * 104729) % 89, (i * 5) % 4, (i * 3) % 3 };
+        g.push(shapes[i]);
+    }
+    expected = reference_dependencies(shapes, commutes);
+    for (std::size_t patch = 1; patch < g.size(); patch++) {
+        ASSERT_EQ(g.dependencies(patch), expected[patch]);
+    }
+}
+
+// the direct dependencies darcs finds for the hunks of g, built as the patch list of a document used to be
+static std::vector<std::vector<std::size_t>> darcs_dependencies(const MiniDoc::PatchGraph & g) {
+    using adapter_t = StringAdapter::CharAdapter;
+    using NAMED = MiniDoc::MiniDoc_T::Info::NAMED<MiniDoc::MiniDoc_T::Info::CORE_FP>;
+    auto lines = [](std::size_t count) {
+        adapter_t adapter;
+        for (std::size_t i = 0; i < count; i++) {
+            adapter.append(adapter.get_new_line());
+        }
+        return adapter;
+    };
+    DarcsPatch::RL<NAMED> patch_list;
+    patch_list = patch_list.push(DarcsPatch::makeNamedWithType<char, adapter_t>(0, "0", DarcsPatch::makeAddFile()));
+    for (std::size_t patch = 1; patch < g.size(); patch++) {
+        auto & shape = g.shape(patch);
+        auto hunk = DarcsPatch::makeHunk<char, adapter_t>(shape.line, lines(shape.old_lines), lines(shape.new_lines));
+        patch_list = patch_list.push(DarcsPatch::makeNamedWithType<char, adapter_t>(patch, std::to_string(patch), hunk));
+    }
+    std::vector<std::vector<std::size_t>> direct;
+    for (auto & pair : DarcsPatch::depsGraph<char, adapter_t>(patch_list)) {
+        std::vector<std::size_t> dependencies;
+        for (auto & dependency : pair.second.v1) {
+            dependencies.push_back(dependency.additional_data);
+        }
+        std::sort(dependencies.begin(), dependencies.end());
+        direct.push_back(dependencies);
+    }
+    return direct;
+}
+
+TEST(MiniDoc, patch_graph_darcs) {
+    std::mt19937 random(41);
+    auto compare = [](const MiniDoc::PatchGraph & g) {
+        auto expected = darcs_dependencies(g);
+        ASSERT_EQ(expected.size(), g.size());
+        for (std::size_t patch = 1; patch < g.size(); patch++) {
+            ASSERT_EQ(g.dependencies(patch), expected[patch]) << "patch " << patch;
+        }
+    };
+    for (int round = 0; round < 20; round++) {
+        // random hunks, empty, touching and overlapping ones included
+        MiniDoc::PatchGraph g;
+        for (int i = 0; i < 60; i++) {
+            g.push({ random() % 30, random() % 4, random() % 4 });
+        }
+        compare(g);
+
+        // the hunks of a random editing history
+        MiniDoc::MiniDoc_T m;
+        m.load("0\n1\n2\n3\n4\n5\n6\n7\n");
+        for (int i = 0; i < 40; i++) {
+            auto pos = random() % (m.length() + 1);
+            switch (random() % 4) {
+                case 0:
+                    m.insert(pos, random() % 2 == 0 ? "a\nb" : "c");
+                    break;
+                case 1:
+                    if (pos < m.length()) {
+                        m.erase(pos, std::min<std::size_t>(1 + random() % 4, m.length() - pos));
+                    }
+                    break;
+                case 2:
+                    m.replace(pos, std::min<std::size_t>(random() % 4, m.length() - pos), "\nd\n");
+                    break;
+                default:
+                    m.undo();
+            }
+        }
+        // blame brings the graph up to date
+        m.blame(0);
+        compare(m.patch_graph());
+    }
+}
+
+TEST(MiniDoc, parallel_graph) {
+    std::vector<MiniDoc::HunkShape> shapes;
+    for (std::size_t i = 0; i < 3000; i++) {
+        shapes.push_back({ (i * 37) % 200, i % 3, (i * 5) % 4 });
+    }
+    MiniDoc::PatchGraph a, b;
+    for (auto & shape : shapes) {
+        a.push(shape);
+    }
+    b.push(std::vector<MiniDoc::HunkShape>(shapes.begin(), shapes.begin() + 10), 4);
+    b.push(std::vector<MiniDoc::HunkShape>(shapes.begin() + 10, shapes.end()), 4);
+    ASSERT_EQ(b.size(), a.size());
+    for (std::size_t patch = 0; patch < a.size(); patch++) {
+        ASSERT_EQ(b.dependencies(patch), a.dependencies(patch));
+    }
+
+    // the backtraces are the same for any number of threads
+    MiniDoc::MiniDoc_T m, n;
+    n.set_graph_threads(4);
+    std::string outputs[2];
+    for (auto d : { &m, &n }) {
+        d->load("0\n1\n2\n3\n");
+        // enough patches for the walks to be shared
+        for (std::size_t i = 0; i < 1100; i++) {
+            d->insert((i * 7) % d->length(), i % 3 == 0 ? "\n" : "x");
+        }
+        std::vector<MiniDoc::MiniDoc_T::Diagnostic> lines;
+        for (std::size_t line = 0; line < d->lines(); line++) {
+            lines.push_back({ line, 0, "" });
+        }
+        testing::internal::CaptureStdout();
+        d->error_batch(lines);
+        outputs[d == &n] = testing::internal::GetCapturedStdout();
+    }
+    ASSERT_EQ(outputs[0], outputs[1]);
+}
+
+TEST(MiniDoc, export_graph) {
+    MiniDoc::MiniDoc_T m;
+    m.load("a\nb\n");
+    m.insert(0, "x");
+    m.insert(0, "y");
+    auto hash = [](std::string name) {
+        SHA1 sha1;
+        return std::string("\"") + sha1(name.data(), name.size()) + "\"";
+    };
+    std::stringstream json;
+    m.export_graph(MiniDoc::MiniDoc_T::GraphFormat::JSON, json);
+    ASSERT_EQ(json.str(),
+        "{\n  \"nodes\": [\n"
+        "    { \"id\": " + hash("0") + ", \"name\": \"0\", \"edit\": 0, \"dependencies\": [] },\n"
+        "    { \"id\": " + hash("1") + ", \"name\": \"1\", \"edit\": 1, \"dependencies\": [" + hash("0") + "] },\n"
+        "    { \"id\": " + hash("2") + ", \"name\": \"2\", \"edit\": 2, \"dependencies\": [" + hash("1") + "] }\n"
+        "  ]\n}\n");
+    std::stringstream dot;
+    m.export_graph(MiniDoc::MiniDoc_T::GraphFormat::DOT, dot);
+    ASSERT_EQ(dot.str(),
+        "digraph {\n   graph [rankdir=LR];\n   node [imagescale=true];\n"
+        "   " + hash("0") + " [label=0]\n   " + hash("1") + " [label=1]\n   " + hash("2") + " [label=2]\n"
+        "   " + hash("1") + " -> {" + hash("0") + "}\n   " + hash("2") + " -> {" + hash("1") + "}\n}\n");
+
+    // a long history reaches the sink in a few large pieces
+    for (int i = 0; i < 900; i++) {
+        m.insert(i % 3, i % 7 == 0 ? "\n" : "z");
+    }
+    std::size_t calls = 0, bytes = 0;
+    m.export_graph(MiniDoc::MiniDoc_T::GraphFormat::JSON, [&](const char * data, std::size_t length) { calls++; bytes += length; });
+    ASSERT_GT(bytes, MiniDoc::BufferedSink::default_capacity);
+    ASSERT_LE(calls, bytes / (MiniDoc::BufferedSink::default_capacity / 2) + 1);
+}
+
+TEST(MiniDoc, undo_edit) {
+    MiniDoc::MiniDoc_T m;
+    m.load("0\n1\n2\n3\n");
+    // #1 on line 1, #2 on line 3, #3 on line 2
+    m.insert(2, "a");
+    m.insert(7, "b");
+    m.replace(5, 1, "c");
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\na1\nc\nb3\n");
+    // #2 is taken back past #3 as a new edit #4
+    ASSERT_TRUE(m.undo_edit(2));
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\na1\nc\n3\n");
+    ASSERT_EQ(m.undoStack().undoSize(), 4);
+
+    // #5 changes the line of #1, which cannot be taken back without it
+    m.insert(3, "d");
+    ASSERT_EQ(m.edit_dependents(1), std::vector<std::size_t>({ 5 }));
+    ASSERT_FALSE(m.undo_edit(1));
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\nad1\nc\n3\n");
+    ASSERT_EQ(m.undoStack().undoSize(), 5);
+    m.undo();
+    ASSERT_TRUE(m.edit_dependents(1).empty());
+    ASSERT_TRUE(m.undo_edit(1));
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\n1\nc\n3\n");
+    // the new edit is undone as any other
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\na1\nc\n3\n");
+
+    ASSERT_THROW(m.undo_edit(0), std::runtime_error);
+    ASSERT_THROW(m.undo_edit(m.undoStack().undoSize() + 1), std::runtime_error);
+    m.begin_transaction();
+    ASSERT_THROW(m.undo_edit(1), std::runtime_error);
+    m.commit();
+
+    // typing next to the text an edit put back starts a record of its own
+    MiniDoc::MiniDoc_T n;
+    MiniDoc::MiniDoc_T::CoalescePolicy policy;
+    policy.inserts = true;
+    n.set_coalesce_policy(policy);
+    n.load("0\n1\n");
+    n.erase(2, 1);
+    ASSERT_TRUE(n.undo_edit(1));
+    n.insert(3, "x");
+    ASSERT_STREQ(n.str().c_str().ptr(), "0\n1x\n");
+    ASSERT_TRUE(n.undo());
+    ASSERT_STREQ(n.str().c_str().ptr(), "0\n1\n");
+    ASSERT_TRUE(n.undo());
+    ASSERT_STREQ(n.str().c_str().ptr(), "0\n\n");
+}
+
+// a document of char32_t, the text of an edit cannot be passed back to it as chars
+struct U32Adapter : public StringAdapter::BasicStringAdapter<char32_t> {
+    U32Adapter() : BasicStringAdapter<char32_t>(U'\n', U'\0') {}
+    U32Adapter(const char32_t * p) : BasicStringAdapter<char32_t>(p, U'\n', U'\0') {}
+    U32Adapter(const char32_t * p, std::size_t len) : BasicStringAdapter<char32_t>(p, len, U'\n', U'\0') {}
+};
+
+TEST(MiniDoc, undo_edit_u32) {
+    MiniDoc::MiniDoc<char32_t, U32Adapter> m;
+    auto text = [&] { return std::u32string(m.str().data().ptr()); };
+    m.load(U"0\n1\n2\n");
+    m.replace(2, 1, U"ab");
+    m.erase(0, 1);
+    m.insert(5, U"c");
+    ASSERT_EQ(text(), U"\nab\n2c\n");
+    // the text each edit replaced is put back from the buffers, nothing is appended
+    auto extent = m.get_info().append_extent();
+    ASSERT_TRUE(m.undo_edit(1));
+    ASSERT_EQ(text(), U"\n1\n2c\n");
+    ASSERT_TRUE(m.undo_edit(2));
+    ASSERT_EQ(text(), U"0\n1\n2c\n");
+    ASSERT_EQ(m.get_info().append_extent(), extent);
+    // the new edits are undone and redone as any other
+    m.undo(2);
+    ASSERT_EQ(text(), U"\nab\n2c\n");
+    m.redo(2);
+    ASSERT_EQ(text(), U"0\n1\n2c\n");
+}
+
+TEST(MiniDoc, squash_history) {
+    MiniDoc::MiniDoc_T m;
+    m.load("0\n1\n2\n3\n");
+    m.insert(2, "a");
+    m.insert(7, "b");
+    m.replace(5, 1, "c");
+    m.insert(0, "d");
+    // #5 and #6 take back #4 and #3 as the redo stack is replayed, #7 follows them
+    m.undo();
+    m.undo();
+    m.insert(m.length(), "e");
+    ASSERT_EQ(m.undoStack().undoSize(), 7);
+    auto blame = m.blame(0, m.lines());
+    ASSERT_EQ(blame, std::vector<std::size_t>({ 5, 1, 6, 2, 7 }));
+
+    // the history starts from the state after #3, the edits keep their numbers
+    m.squash_history(3);
+    ASSERT_EQ(m.undoStack().undoSize(), 4);
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\na1\n2\nb3\ne");
+    ASSERT_EQ(m.blame(0, m.lines()), blame);
+    ASSERT_TRUE(m.edit_dependents(7).empty());
+    ASSERT_THROW(m.edit_dependents(3), std::runtime_error);
+
+    // the lines of the folded edits keep their blame at the base
+    m.undo_to(0);
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\na1\nc\nb3\n");
+    ASSERT_EQ(m.blame(0, m.lines()), std::vector<std::size_t>({ 0, 1, 3, 2, 0 }));
+    ASSERT_FALSE(m.undo());
+    testing::internal::CaptureStdout();
+    m.error_batch({ { 1, 0, "" } });
+    ASSERT_NE(testing::internal::GetCapturedStdout().find(" edit #1: SQUASHED"), std::string::npos);
+    m.undo_to(4);
+    ASSERT_STREQ(m.str().c_str().ptr(), "0\na1\n2\nb3\ne");
+    ASSERT_EQ(m.blame(0, m.lines()), blame);
+
+    // a restored document numbers its edits on from the squashed ones, the folded lines are blamed at the base
+    std::stringstream saved;
+    m.save(saved);
+    MiniDoc::MiniDoc_T n;
+    n.restore(saved);
+    ASSERT_STREQ(n.str().c_str().ptr(), "0\na1\n2\nb3\ne");
+    ASSERT_EQ(n.blame(0, n.lines()), std::vector<std::size_t>({ 5, 0, 6, 0, 7 }));
+    ASSERT_TRUE(n.edit_dependents(7).empty());
+    ASSERT_THROW(n.edit_dependents(3), std::runtime_error);
+    n.insert(0, "f");
+    ASSERT_EQ(n.blame(0, 1), std::vector<std::size_t>({ 8 }));
+    n.load("0\n");
+    n.insert(0, "g");
+    ASSERT_EQ(n.blame(0, n.lines()), std::vector<std::size_t>({ 1, 0 }));
+
+    ASSERT_THROW(m.squash_history(5), std::runtime_error);
+    m.begin_transaction();
+    ASSERT_THROW(m.squash_history(1), std::runtime_error);
+    m.commit();
+}
+
+TEST(MiniDoc, blame) {
+    MiniDoc::MiniDoc_T m;
+    m.load("0\n1\n2\n3\n");
+    // #1 changes line 1
+    m.insert(2, "x");
+    // #2 adds a line after line 2, both halves are blamed on it
+    m.insert(5, "\n");
+    ASSERT_EQ(m.blame(0, m.lines()), std::vector<std::size_t>({ 0, 1, 2, 2, 0, 0 }));
+    // #3 joins lines 0 and 1
+    m.erase(1, 1);
+    ASSERT_EQ(m.blame(0, m.lines()), std::vector<std::size_t>({ 3, 2, 2, 0, 0 }));
+    ASSERT_EQ(m.blame(0), 3);
+    ASSERT_EQ(m.blame(3, 100), std::vector<std::size_t>({ 0, 0 }));
+    // the blame follows the history back
+    m.undo();
+    ASSERT_EQ(m.blame(0, m.lines()), std::vector<std::size_t>({ 0, 1, 2, 2, 0, 0 }));
+    m.begin_transaction();
+    ASSERT_THROW(m.blame(0), std::runtime_error);
+    m.commit();
+}
+
+TEST(MiniDoc, history_view) {
+    MiniDoc::MiniDoc_T m;
+    m.set_checkpoint_interval(4);
+    m.load("0\n1\n2\n");
+    std::vector<std::string> texts { m.str().c_str().ptr() };
+    for (int i = 0; i < 20; i++) {
+        if (i % 3 == 0) {
+            m.erase(i % m.length(), 2);
+        } else if (i % 3 == 1) {
+            m.replace(i % m.length(), 1, "ab\n");
+        } else {
+            m.insert(i % m.length(), "c\n");
+        }
+        texts.push_back(m.str().c_str().ptr());
+    }
+    // the last edits are only reachable through the redo stack
+    m.undo();
+    m.undo();
+    m.undo();
+    m.seek(5);
+    auto text = texts[17];
+    auto version = m.version();
+    for (std::size_t i = 0; i < texts.size(); i++) {
+        auto view = m.view_at(i);
+        ASSERT_EQ(view.index(), i);
+        ASSERT_STREQ(view.str().c_str().ptr(), texts[i].c_str());
+        std::string lines;
+        for (std::size_t l = 0; l < view.lines(); l++) {
+            ASSERT_EQ(view.line(view.line_start(l)), l);
+            lines += view.line_str(l).c_str().ptr();
+        }
+        ASSERT_EQ(lines, texts[i]);
+        ASSERT_EQ(view.lines(), std::count(texts[i].begin(), texts[i].end(), '\n') + 1);
+        ASSERT_EQ(view.line(view.length() + 1), view.lines() - 1);
+    }
+    ASSERT_THROW(m.view_at(texts.size()), std::runtime_error);
+    // neither views nor backtraces move the document or its history
+    backtraces(m);
+    ASSERT_STREQ(m.str().c_str().ptr(), text.c_str());
+    ASSERT_EQ(m.undoStack().undoSize(), 17);
+    ASSERT_EQ(m.undoStack().redoSize(), 3);
+    ASSERT_EQ(m.version(), version);
+    m.begin_transaction();
+    ASSERT_THROW(m.view_at(0), std::runtime_error);
+    m.commit();
+}
+
+TEST(MiniDoc, error_batch) {
+    MiniDoc::MiniDoc_T m;
+    m.load("0\n1\n2\n3\n4\n5\n6\n7\n");
+    for (int i = 0; i < 30; i++) {
+        m.insert((i * 7) % m.length(), i % 5 == 0 ? "y\n" : "x");
+    }
+    m.seek(3);
+    std::vector<MiniDoc::MiniDoc_T::Diagnostic> diagnostics {
+        { 5, 1, "d0" }, { 1, 0, "d1" }, { 3, 1, "d2" }, { 1, 1, "d3" }, { m.lines() - 1, 0, "" }, { 0, 0, "d5" }
+    };
+    // the same as one error per diagnostic, in the order of their lines
+    auto sorted = diagnostics;
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto & a, auto & b) { return a.line < b.line; });
+    testing::internal::CaptureStdout();
+    for (auto & d : sorted) {
+        m.seek_line(d.line);
+        m.seek(m.line_start() + d.column);
+        m.error(d.message);
+    }
+    auto expected = testing::internal::GetCapturedStdout();
+    m.seek(3);
+    testing::internal::CaptureStdout();
+    m.error_batch(diagnostics);
+    ASSERT_EQ(testing::internal::GetCapturedStdout(), expected);
+    ASSERT_EQ(m.cursor(), 3);
+    m.begin_transaction();
+    ASSERT_THROW(m.error_batch(diagnostics), std::runtime_error);
+    m.commit();
+}
+
+TEST(MiniDoc, history_spill) {
+    MiniDoc::MiniDoc_T a, b;
+    b.set_history_budget(1);
+    for (auto m : { &a, &b }) {
+        m->load("");
+        for (int i = 0; i < 50; i++) {
+            m->append(std::to_string(i).c_str());
+            if (i % 7 == 0) {
+                m->erase(0, 1);
+            }
+        }
+        for (int i = 0; i < 10; i++) {
+            m->undo();
+        }
+        m->append("x");
+    }
+    // only the command of the current node stays in memory
+    ASSERT_NE(b.undoStack().cold_raw_bytes(), 0);
+    ASSERT_LT(b.undoStack().history_resident_bytes(), a.undoStack().history_resident_bytes());
+    std::stringstream sa, sb;
+    sa << a.undoStack();
+    sb << b.undoStack();
+    ASSERT_EQ(sa.str(), sb.str());
+    while (a.undo()) {
+        ASSERT_TRUE(b.undo());
+        ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+    }
+    ASSERT_STREQ(b.str().c_str().ptr(), "");
+}
+
+TEST(MiniDoc, cold_history) {
+    for (auto text : { std::string(""), std::string("abcabcabcabd"), std::string(70000, 'x') + "abcdefgh" + std::string(300, 'y') }) {
+        ASSERT_EQ(MiniDoc::LZ::decompress(MiniDoc::LZ::compress(text)), text);
+    }
+    // small blocks, so a short history fills several of them, see MiniDoc_Benchmarks for a long one
+    MiniDoc::MiniDoc_T a, b, c;
+    for (auto m : { &b, &c }) {
+        m->set_history_budget(1);
+        m->set_cold_block_size(1024);
+    }
+    c.set_cold_storage(MiniDoc::ColdStorage::MEMORY);
+    for (auto m : { &a, &b, &c }) {
+        m->load("");
+        for (int i = 0; i < 300; i++) {
+            m->append(std::to_string(i).c_str());
+            if (i % 3 == 0) {
+                m->erase(i % 5, 2);
+            }
+        }
+    }
+    // enough records to fill several compressed blocks
+    for (auto m : { &b, &c }) {
+        ASSERT_GT(m->undoStack().cold_raw_bytes(), 4 * 1024);
+        ASSERT_LT(m->undoStack().cold_stored_bytes(), m->undoStack().cold_raw_bytes());
+    }
+    while (a.undo()) {
+        ASSERT_TRUE(b.undo());
+        ASSERT_TRUE(c.undo());
+        ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+        ASSERT_STREQ(a.str().c_str().ptr(), c.str().c_str().ptr());
+    }
+    while (a.redo()) {
+        ASSERT_TRUE(b.redo());
+        ASSERT_TRUE(c.redo());
+    }
+    ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+    ASSERT_STREQ(a.str().c_str().ptr(), c.str().c_str().ptr());
+
+    // a block is dropped once none of its records are needed, and the file space of a dropped block is reused
+    MiniDoc::ColdStore store;
+    store.set_block_size(1024);
+    std::vector<std::pair<uint64_t, std::string>> records;
+    for (int i = 0; i < 2000; i++) {
+        auto record = std::to_string(i) + std::string(i % 7, 'r');
+        records.push_back({ store.write(record), record });
+    }
+    auto stored = store.stored_bytes();
+    auto file = store.file_bytes();
+    for (int i = 0; i < 1500; i++) {
+        store.release(records[i].first, records[i].second.size());
+    }
+    ASSERT_LT(store.stored_bytes(), stored / 2);
+    for (int i = 1500; i < 2000; i++) {
+        ASSERT_EQ(store.read(records[i].first, records[i].second.size()), records[i].second);
+    }
+    for (int i = 0; i < 1000; i++) {
+        records.push_back({ store.write(records[i].second), records[i].second });
+    }
+    ASSERT_EQ(store.file_bytes(), file);
+    for (std::size_t i = 1500; i < records.size(); i++) {
+        ASSERT_EQ(store.read(records[i].first, records[i].second.size()), records[i].second);
+    }
+
+    // records of edits that can no longer be redone are released with them
+    MiniDoc::MiniDoc_T d;
+    d.set_history_budget(1);
+    d.set_cold_block_size(1024);
+    d.load("");
+    d.set_supports_redo(false);
+    for (int i = 0; i < 300; i++) {
+        d.append(std::to_string(i).c_str());
+    }
+    ASSERT_GT(d.undoStack().cold_stored_bytes(), 0);
+    while (d.undo()) {
+    }
+    ASSERT_EQ(d.undoStack().cold_stored_bytes(), 0);
+}
+
+TEST(MiniDoc, save_restore) {
+    MiniDoc::MiniDoc_T a, b;
+    a.load("hello\nworld");
+    for (int i = 0; i < 40; i++) {
+        a.insert(i % 7, std::to_string(i).c_str());
+        if (i % 5 == 0) {
+            a.replace(2, 3, "xy");
+        }
+        if (i % 11 == 0) {
+            a.undo();
+            a.undo();
+        }
+    }
+    a.undo();
+    a.seek(3);
+    std::stringstream saved;
+    a.save(saved);
+    b.set_history_budget(1);
+    b.restore(saved);
+    ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+    ASSERT_EQ(a.cursor(), b.cursor());
+    std::stringstream sa, sb;
+    sa << a.undoStack();
+    sb << b.undoStack();
+    ASSERT_EQ(sa.str(), sb.str());
+    while (a.undo()) {
+        ASSERT_TRUE(b.undo());
+        ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+    }
+    ASSERT_FALSE(b.undo());
+    while (a.redo()) {
+        ASSERT_TRUE(b.redo());
+        ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+    }
+    // a restored document keeps editing from where it was saved
+    a.append("!");
+    b.append("!");
+    ASSERT_TRUE(a.undo());
+    ASSERT_TRUE(b.undo());
+    ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+
+    std::stringstream garbage("MiniDoc\0garbage");
+    ASSERT_THROW(b.restore(garbage), std::runtime_error);
+    ASSERT_EQ(b.length(), 0);
+    ASSERT_EQ(b.undoStack().undoSize(), 0);
+
+    // the buffers are read from the stream in place, a stream cut short within them is rejected
+    std::stringstream full;
+    a.save(full);
+    for (std::size_t cut : { (std::size_t) 12, (std::size_t) 20, full.str().size() / 2 }) {
+        std::stringstream truncated(full.str().substr(0, cut));
+        ASSERT_THROW(b.restore(truncated), std::runtime_error);
+        ASSERT_EQ(b.length(), 0);
+    }
+}
+
+TEST(MiniDoc, move) {
+    MiniDoc::MiniDoc_T a;
+    a.set_history_budget(1);
+    a.load("hello\nworld");
+    for (int i = 0; i < 20; i++) {
+        a.insert(i % 5, std::to_string(i).c_str());
+    }
+    auto view = a.view_at(3);
+    auto text = std::string(view.str().c_str().ptr());
+    // the spilled records are read back for the Info they were recorded against, which moves with the document
+    MiniDoc::MiniDoc_T b(std::move(a));
+    ASSERT_EQ(std::string(view.str().c_str().ptr()), text);
+    ASSERT_EQ(b.undo(17), 17);
+    ASSERT_STREQ(b.str().c_str().ptr(), text.c_str());
+    MiniDoc::MiniDoc_T c;
+    c = std::move(b);
+    ASSERT_EQ(c.redo(17), 17);
+    ASSERT_EQ(c.undo(20), 20);
+    ASSERT_STREQ(c.str().c_str().ptr(), "hello\nworld");
+}
+
+TEST(MiniDoc, tree_command) {
+    MiniDoc::MiniDoc_T m;
+    m.set_history_budget(1);
+    m.load("abc");
+    for (int i = 0; i < 10; i++) {
+        m.insert(0, "x");
+    }
+    auto & stack = m.undoStack();
+    ASSERT_EQ(stack.command(stack.root()), nullptr);
+    std::size_t spilled = 0;
+    for (auto node = stack.root()->child(0); node != nullptr; node = node->child(0)) {
+        if (node->resident_command() == nullptr) {
+            spilled++;
+        }
+        // a spilled command is read back on access
+        ASSERT_NE(stack.command(node), nullptr);
+        ASSERT_EQ(stack.command(node), node->resident_command());
+    }
+    ASSERT_NE(spilled, 0);
+}
+
+TEST(MiniDoc, undo_batch) {
+    MiniDoc::MiniDoc_T a, b;
+    for (auto m : { &a, &b }) {
+        m->set_checkpoint_interval(8);
+        m->load("one\ntwo\nthree");
+        for (int i = 0; i < 60; i++) {
+            m->insert((i * 7) % (m->length() + 1), i % 4 == 0 ? "\n" : std::to_string(i).c_str());
+            if (i % 6 == 0) {
+                m->erase(i % 5, 3);
+            }
+            if (i % 9 == 0) {
+                m->replace(1, 2, "ab\ncd");
+            }
+        }
+    }
+    auto same = [&] {
+        ASSERT_STREQ(a.str().c_str().ptr(), b.str().c_str().ptr());
+        ASSERT_EQ(a.lines(), b.lines());
+        ASSERT_EQ(a.line(), b.line());
+        ASSERT_EQ(a.undoStack().undoSize(), b.undoStack().undoSize());
+        ASSERT_EQ(a.undoStack().redoSize(), b.undoStack().redoSize());
+    };
+    // seeking from a checkpoint reinstates the text without appending it again
+    auto extent = a.get_info().append_extent();
+    ASSERT_EQ(a.undo(25), 25);
+    for (int i = 0; i < 25; i++) {
+        ASSERT_TRUE(b.undo());
+    }
+    same();
+    ASSERT_EQ(a.redo(10), 10);
+    for (int i = 0; i < 10; i++) {
+        ASSERT_TRUE(b.redo());
+    }
+    same();
+    ASSERT_TRUE(a.undo_to(3));
+    while (b.undoStack().undoSize() != 3) {
+        ASSERT_TRUE(b.undo());
+    }
+    same();
+    ASSERT_FALSE(a.undo_to(a.undoStack().undoSize() + a.undoStack().redoSize() + 1));
+    auto redo_size = a.undoStack().redoSize();
+    ASSERT_EQ(a.redo(1000), redo_size);
+    while (b.redo()) {}
+    same();
+    auto undo_size = a.undoStack().undoSize();
+    ASSERT_EQ(a.undo(1000), undo_size);
+    while (b.undo()) {}
+    same();
+    ASSERT_STREQ(a.str().c_str().ptr(), "one\ntwo\nthree");
+    ASSERT_EQ(a.get_info().append_extent(), extent);
+}
+
+TEST(MiniDoc, reclaim) {
+    MiniDoc::Reclaimer reclaimer;
+    MiniDoc::MiniDoc_T m;
+    m.set_reclaimer(&reclaimer);
+    m.set_history_budget(64);
+    for (int round = 0; round < 3; round++) {
+        m.load("abc");
+        for (int i = 0; i < 200; i++) {
+            m.insert(i % 3, std::to_string(i).c_str());
+        }
+        m.undo(50);
+    }
+    m.load("xyz");
+    m.append("!");
+    ASSERT_STREQ(m.str().c_str().ptr(), "xyz!");
+    ASSERT_TRUE(m.undo());
+    ASSERT_STREQ(m.str().c_str().ptr(), "xyz");
+    reclaimer.drain();
+    ASSERT_EQ(reclaimer.pending(), 0);
+
+    // the history dropped by reset outlives the call
+    auto text = std::make_shared<int>(0);
+    struct Command : MiniDoc::UndoStack<int>::Command {
+        std::shared_ptr<int> text;
+        Command(std::shared_ptr<int> text) : text(text) {}
+        void undo(int * instance) override {}
+        void redo(int * instance) override {}
+    };
+    MiniDoc::UndoStack<int> stack;
+    stack.set_reclaimer(&reclaimer);
+    stack.emplace<Command>(text);
+    // and is neither printed nor read back on the calling thread
+    testing::internal::CaptureStdout();
+    stack.reset();
+    ASSERT_EQ(testing::internal::GetCapturedStdout(), "");
+    ASSERT_EQ(stack.undoSize(), 0);
+    reclaimer.drain();
+    ASSERT_EQ(text.use_count(), 1);
+
+    // in basic mode an edit after an undo drops the undone commands
+    stack.supports_advanced_undo = false;
+    stack.emplace<Command>(text);
+    stack.emplace<Command>(text);
+    ASSERT_TRUE(stack.undo(nullptr));
+    stack.emplace<Command>(std::make_shared<int>(0));
+    ASSERT_EQ(stack.root()->child(0)->child_count(), 1);
+    reclaimer.drain();
+    ASSERT_EQ(text.use_count(), 2);
+}
+
+TEST(MiniDoc, undo_drop) {
+    for (bool advanced : { false, true }) {
+        for (bool redo : { false, true }) {
+            if (advanced && redo) {
+                // an edit after an undo branches the history, which keeps every node
+                continue;
+            }
+            MiniDoc::MiniDoc_T m;
+            m.load("abc");
+            m.set_supports_advanced_undo(advanced);
+            m.set_supports_redo(redo);
+            m.insert(0, "x");
+            ASSERT_TRUE(m.undo());
+            m.insert(0, "x");
+            auto nodes = m.undoStack().node_count();
+            auto arena = m.undoStack().arena_capacity();
+            for (int i = 0; i < 1000; i++) {
+                m.insert(1, "y");
+                ASSERT_TRUE(m.undo());
+                if (i % 3 == 0) {
+                    ASSERT_TRUE(m.undo());
+                    ASSERT_EQ(m.redo(), redo);
+                    if (!redo) {
+                        m.insert(0, "x");
+                    }
+                }
+            }
+            // with redo the undone edit is only dropped by the next edit
+            ASSERT_EQ(m.undoStack().node_count(), nodes + (redo ? 1 : 0));
+            ASSERT_EQ(m.undoStack().arena_capacity(), arena);
+            ASSERT_STREQ(m.str().c_str().ptr(), "xabc");
+            ASSERT_TRUE(m.undo());
+            ASSERT_STREQ(m.str().c_str().ptr(), "abc");
+        }
+    }
+}
+
+TEST(MiniDoc, transaction) {
+    MiniDoc::MiniDoc_T m;
+    m.load("hello\nworld");
+    m.append("!");
+    m.seek(2);
+    auto size = m.undoStack().undoSize();
+
+    m.begin_transaction();
+    m.insert(0, "a\nb\n");
+    m.erase(3, 4);
+    m.replace(1, 2, "xyz");
+    ASSERT_THROW(m.undo(), std::runtime_error);
+    m.rollback();
+    ASSERT_FALSE(m.in_transaction());
+    ASSERT_STREQ(m.str().c_str().ptr(), "hello\nworld!");
+    ASSERT_EQ(m.lines(), 2);
+    ASSERT_EQ(m.cursor(), 2);
+    ASSERT_EQ(m.undoStack().undoSize(), size);
+
+    m.begin_transaction();
+    m.insert(0, "1\n");
+    m.begin_transaction();
+    m.erase(0, 8);
+    m.rollback();
+    m.replace(2, 5, "HELLO");
+    m.commit();
+    ASSERT_STREQ(m.str().c_str().ptr(), "1\nHELLO\nworld!");
+    ASSERT_EQ(m.lines(), 3);
+    ASSERT_EQ(m.undoStack().undoSize(), size + 1);
+    ASSERT_TRUE(m.undo());
+    ASSERT_STREQ(m.str().c_str().ptr(), "hello\nworld!");
+    ASSERT_TRUE(m.redo());
+    ASSERT_STREQ(m.str().c_str().ptr(), "1\nHELLO\nworld!");
+
+    // typing next to a committed transaction starts a record of its own
+    MiniDoc::MiniDoc_T::CoalescePolicy policy;
+    policy.inserts = true;
+    m.set_coalesce_policy(policy);
+    m.begin_transaction();
+    m.insert(0, "ab");
+    m.commit();
+    m.insert(2, "c");
+    ASSERT_STREQ(m.str().c_str().ptr(), "abc1\nHELLO\nworld!");
+    ASSERT_TRUE(m.undo());
+    ASSERT_STREQ(m.str().c_str().ptr(), "ab1\nHELLO\nworld!");
+    ASSERT_TRUE(m.undo());
+    ASSERT_STREQ(m.str().c_str().ptr(), "1\nHELLO\nworld!");
+    m.set_coalesce_policy({});
+
+    // a transaction that changes nothing is not recorded
+    m.begin_transaction();
+    m.insert(0, "x");
+    m.erase(0, 1);
+    m.commit();
+    ASSERT_EQ(m.undoStack().undoSize(), size + 1);
+    ASSERT_THROW(m.commit(), std::runtime_error);
+}
+
 TEST(MiniDoc, undo_redo__insert) {
     MiniDoc::MiniDoc_T m;
     m.load("");
@@ -538,3 +1646,82 @@ TEST(MiniDoc, undo_redo__replace_2) {
     m.redo();
     ASSERT_STREQ(m.str().c_str().ptr(), "Bwrh");
 }
+
+TEST(MiniDoc, undo_redo__toggle) {
+    MiniDoc::MiniDoc_T m;
+    m.load("0\n1\n");
+    // a large paste in the middle of the loaded text, replacing part of it
+    std::string paste;
+    for (int i = 0; i < 4096; i++) {
+        paste.push_back(i % 64 == 63 ? '\n' : 'a' + i % 26);
+    }
+    m.insert(2, paste.c_str());
+    m.replace(0, 3, "xy");
+    auto extent = m.get_info().append_extent();
+    auto text = std::string(m.str().c_str().ptr());
+    for (int i = 0; i < 1000; i++) {
+        m.undo();
+        m.undo();
+        m.redo();
+        m.redo();
+    }
+    ASSERT_EQ(m.str().c_str().ptr(), text);
+    // the restored text is the text already in the buffers
+    ASSERT_EQ(m.get_info().append_extent(), extent);
+    m.undo();
+    ASSERT_STREQ(m.str().c_str().ptr(), ("0\n" + paste + "1\n").c_str());
+}
+
+struct StaticCacheTarget {
+    mutable int calls = 0;
+    int twice(int x) const {
+        calls++;
+        return x * 2;
+    }
+    MINIDOC_STATIC_CACHE_FUNC(cache_twice, StaticCacheTarget::twice);
+};
+
+TEST(MiniDoc, static_cache) {
+    StaticCacheTarget t;
+    ASSERT_EQ(t.cache_twice(&t, 4), 8);
+    ASSERT_EQ(t.cache_twice(&t, 4), 8);
+    ASSERT_EQ(t.calls, 1);
+    ASSERT_EQ(t.cache_twice(&t, 5), 10);
+    ASSERT_EQ(t.calls, 2);
+    MiniDoc::StaticCacheInvalidator::invalidate(std::tie(t.cache_twice));
+    ASSERT_EQ(t.cache_twice(&t, 5), 10);
+    ASSERT_EQ(t.calls, 3);
+}
+
+TEST(MiniDoc, line_cache) {
+    MiniDoc::MiniDoc_T m;
+    m.set_line_cache_budget(4096);
+    m.load("zero\none\ntwo\nthree");
+    auto & cache = m.get_info().get_line_cache();
+    for (std::size_t l = 0; l < 4; l++) {
+        m.seek_line(l);
+        m.line_str();
+    }
+    ASSERT_EQ(cache.size(), 4);
+    ASSERT_EQ(cache.misses(), 4);
+    m.seek_line(1);
+    m.insert(m.cursor(), "ONE\n");
+    // line 1 was edited, line 0 is untouched, lines 2 and 3 moved down by one
+    ASSERT_EQ(cache.size(), 3);
+    m.seek_line(0);
+    ASSERT_STREQ(m.line_str().c_str().ptr(), "zero\n");
+    m.seek_line(3);
+    ASSERT_STREQ(m.line_str().c_str().ptr(), "two\n");
+    m.seek_line(4);
+    ASSERT_STREQ(m.line_str().c_str().ptr(), "three");
+    ASSERT_EQ(cache.hits(), 3);
+    m.seek_line(1);
+    ASSERT_STREQ(m.line_str().c_str().ptr(), "ONE\n");
+    m.undo();
+    m.seek_line(1);
+    ASSERT_STREQ(m.line_str().c_str().ptr(), "one\n");
+    m.seek_line(3);
+    ASSERT_STREQ(m.line_str().c_str().ptr(), "three");
+    m.set_line_cache_budget(1);
+    ASSERT_EQ(cache.size(), 0);
+}